@@ -16,32 +16,37 @@
 #include <assert.h>
 #include <stdbool.h>
 
-#define STD_CHUNK_SIZE 64
 #define STD_BUF_SIZE 1024
 #define STD_BUF_SIZE_MULT 2
 
+/* tracking macros replace malloc and friends, so they go before any code that allocates */
+#include "../common/alloc.h"
+#include "../common/input.h"
+
 char *remove_extra_whitespaces_in_line(const char *line);
 char **remove_extra_whitespaces_in_text(const char **text, size_t n);
 void print_text(const char **text, size_t n);
 void delete_text(char **text, size_t n);
-char *read_line(void);
+char *copy_line(const input_view_t *line);
 char **read_text(size_t *n);
-bool handle_realloc_line_error(char **line, size_t size);
 bool handle_realloc_text_error(char ***text, size_t size, size_t n);
 int shutdown_with_error(void);
 
 int main(void) {
 	size_t n;
+	set_allocation_stage("read_text");
 	char **raw_text = read_text(&n);
 	if (!raw_text)
 		return shutdown_with_error();
 
+	set_allocation_stage("remove_extra_whitespaces_in_text");
 	char **corrected_text = remove_extra_whitespaces_in_text(
 			(const char **) raw_text, n);
 	delete_text(raw_text, n);
 	if (!corrected_text)
 		return shutdown_with_error();
 
+	set_allocation_stage("print_text");
 	print_text((const char **) corrected_text, n);
 	delete_text(corrected_text, n);
 }
@@ -106,55 +111,15 @@ void delete_text(char **text, size_t n) {
 	free(text);
 }
 
-/* returns amount of readed chars */
-size_t read_chunk(char *line) {
+/* copies a line view into a new string */
+char *copy_line(const input_view_t *line) {
 	assert(line);
-	char chunk[STD_CHUNK_SIZE];
-	if (!fgets(chunk, STD_CHUNK_SIZE, stdin))
-		return 0;
-	const size_t len = strlen(chunk);
-	memcpy(line, chunk, (len + 1) * sizeof *line);
-	return len;
-}
-
-/* if error — frees memory, sets pointer to NULL and returns true */
-bool handle_realloc_line_error(char **pline, size_t size) {
-	assert(pline && *pline && size);
-	char *tmp = realloc(*pline, size);
-	if (!tmp)
-		free(*pline);
-	*pline = tmp;
-	return !tmp;
-}
-
-char *read_line(void) {
-	size_t buf_size = STD_BUF_SIZE;
-	char *buf = malloc(buf_size * sizeof *buf);
-	if (!buf)
+	char *copy = malloc((line->length + 1) * sizeof *copy);
+	if (!copy)
 		return NULL;
-
-	size_t offset = 0;
-	while (true) {
-		if (offset + STD_CHUNK_SIZE - 1 > buf_size) {
-			buf_size *= STD_BUF_SIZE_MULT;
-			if (handle_realloc_line_error(&buf, buf_size * sizeof *buf))
-				return NULL;
-		}
-		const size_t len = read_chunk(buf + offset);
-		offset += len;
-		if (len + 1 != STD_CHUNK_SIZE || buf[offset] == '\n')
-			break;
-	}
-
-	if (!offset) {
-		if (handle_realloc_line_error(&buf, 1 * sizeof *buf))
-			return NULL;
-		*buf = '\0';
-	}
-	else if (offset + 1 < buf_size)
-		handle_realloc_line_error(&buf, buf_size * sizeof *buf);
-
-	return buf;
+	memcpy(copy, line->begin, line->length * sizeof *copy);
+	copy[line->length] = '\0';
+	return copy;
 }
 
 /* if error — deletes text, sets pointer to NULL and returns true */
@@ -169,28 +134,41 @@ bool handle_realloc_text_error(char ***ptext, size_t size, size_t n) {
 
 char **read_text(size_t *n) {
 	assert(n);
+	input_t input;
+	if (!open_input(&input, STDIN_FILENO))
+		return NULL;
+
 	size_t buf_size = STD_BUF_SIZE;
 	char **buf = malloc(buf_size * sizeof *buf);
-	if (!buf)
+	if (!buf) {
+		close_input(&input);
 		return NULL;
+	}
 
+	/* the text ends with an empty line, as fgets gave at the end of input */
 	*n = 0;
-	while ((buf[*n] = read_line())) {
-		if (!*buf[(*n)++])
-			break;
-		if (*n == buf_size) {
+	input_view_t line;
+	bool has_line;
+	do {
+		has_line = read_line_view(&input, &line);
+		if (!has_line)
+			line = (input_view_t) { "", 0 };
+		if (input.failed || !(buf[*n] = copy_line(&line))) {
+			delete_text(buf, *n);
+			close_input(&input);
+			return NULL;
+		}
+		if (++*n == buf_size) {
 			buf_size *= STD_BUF_SIZE_MULT;
-			if (handle_realloc_text_error(&buf, buf_size * sizeof *buf, *n))
+			if (handle_realloc_text_error(&buf, buf_size * sizeof *buf, *n)) {
+				close_input(&input);
 				return NULL;
+			}
 		}
-	}
-
-	if (ferror(stdin)) {
-		delete_text(buf, *n);
-		return NULL;
-	}
+	} while (has_line);
+	close_input(&input);
 
-	if (*n && *n < buf_size)
+	if (*n < buf_size)
 		handle_realloc_text_error(&buf, *n * sizeof *buf, *n);
 
 	return buf;
@@ -7,23 +7,41 @@
 
 // О функциях ввода и вывода
 //
-// Функции вида `error_t sread_TYPE(const char **run, TYPE *data, size_t skip);` считывают из
-// строки `*run` переменную `data` и, при успешном считывании, перемещают `*run` в конец считанной
-// переменной, пропуская затем `skip` символов. Иначе возвращают ошибку NOT_A_TYPE.
+// Функции вида `error_t read_TYPE(input_t *stream, TYPE *data);` считывают переменную `data` из
+// потока ввода, пропуская пробелы и переводы строк. Иначе возвращают ошибку NOT_A_TYPE. Строки
+// (запросы сервера) читаются теми же функциями через `open_text_input`.
 //
 // Функции вида `void write_TYPE(const TYPE *data);` записывают в stdout переменную `data`.
 //
-// Функции вида `void swrite_TYPE(char **run, const TYPE *data);` записывают в строку `*run`
-// переменную `data` и перемещают `*run` на количество записанных символов.
+// Вектор может быть задан ссылкой на файл `<path>` с упакованными 64-битными координатами в
+// порядке little-endian. Такой файл отображается в память и используется без копирования. Путь
+// задаётся относительно рабочего каталога. Пробелы и переводы строк внутри `<...>` пропускаются,
+// как и везде во вводе, поэтому `< a .bin >` — это `a.bin`, а путь с пробелами задать нельзя.
 //
-// Функции вида `void swrite_TYPE_with(char **run, const TYPE *data, char c);` помимо этого
-// записывают ещё и символ `c`.
+// Запись в stdout буферизуется в `output_buf` и сбрасывается через `write(2)` при переполнении
+// буфера или вызове `flush_output`, поэтому перед завершением программы его нужно вызвать.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
 
 // ──── error ─────────────────────────────────────────────────────────────────────────────────────
 
@@ -34,76 +52,436 @@ typedef enum {
 	NOT_A_VECTOR,
 	NOT_AN_OPERAND,
 	NOT_AN_OPERATOR,
+	NOT_A_NAME,
+	NOT_A_PATH,
+	IO_FAILURE,
 	INVALID_FORMAT,
+	ARITHMETIC_OVERFLOW,
 } error_t;
 
+// ──── allocation ────────────────────────────────────────────────────────────────────────────────
+
+// Учёт памяти по местам выделения (-DTRACK_ALLOCATIONS=1) — общий модуль `common/alloc.h`.
+// Он подключается до всего кода, который выделяет память.
+
+#include "../common/alloc.h"
+
 // ──── common ────────────────────────────────────────────────────────────────────────────────────
 
 #define STD_BUF_SIZE 1024
 #define STD_BUF_SIZE_MULT 2
 
 static inline size_t maxlu(size_t a, size_t b) { return a > b ? a : b; }
+static inline size_t minlu(size_t a, size_t b) { return a < b ? a : b; }
+static inline size_t bit_length(uint64_t a) { return a ? 64 - __builtin_clzll(a) : 0; }
 
 #define EOL '\n'
+#define ERROR_MESSAGE "[error]"
 #define EOS '\0'
 #define WHITESPACE ' '
 
-static inline void _skip(const char **run, size_t skip) {
-	assert(run && *run);
-	*run += skip;
-}
-
 static inline error_t _shutdown_with_free(error_t error, void *pdata) {
 	free(pdata);
 	return error;
 }
 
-// ──── char ──────────────────────────────────────────────────────────────────────────────────────
+// ──── output ────────────────────────────────────────────────────────────────────────────────────
 
-error_t sread_char(const char **run, char c, size_t skip) {
-	assert(run && *run);
-	if (**run == c) {
-		++*run;
-		_skip(run, skip);
-		return SUCCESS;
+#define OUTPUT_BUF_SIZE (1 << 16)
+
+static char output_buf[OUTPUT_BUF_SIZE];
+static size_t output_size = 0;
+static int output_fd = STDOUT_FILENO;
+
+/* Записывает в вывод `size` байт, минуя буфер вывода. Возвращает false в случае ошибки */
+bool _write_all(const void *data, size_t size) {
+	assert(data || !size);
+	const char *run = data;
+	while (size) {
+		const ssize_t written = write(output_fd, run, size);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		run += written;
+		size -= written;
 	}
-	return INVALID_FORMAT;
+	return true;
+}
+
+/* Сбрасывает буфер вывода. Возвращает false в случае ошибки записи */
+bool flush_output(void) {
+	const bool success = _write_all(output_buf, output_size);
+	output_size = 0;
+	return success;
+}
+
+/* Гарантирует, что в буфере вывода есть место для `size` символов */
+static inline char *_reserve_output(size_t size) {
+	assert(size <= OUTPUT_BUF_SIZE);
+	if (output_size + size > OUTPUT_BUF_SIZE)
+		flush_output();
+	return output_buf + output_size;
+}
+
+// ──── input ─────────────────────────────────────────────────────────────────────────────────────
+
+// Ввод `input_t` из общего модуля `common/input.h` отдаёт символы по одному, пропуская пробелы и
+// переводы строк. Так выражение разбирается за один проход, а в памяти остаются только значения
+// операндов. Модуль подключается здесь, чтобы его выделения памяти учитывал TRACK_ALLOCATIONS.
+
+#include "../common/input.h"
+
+static inline bool _is_skipped(char c) { return c == WHITESPACE || c == EOL; }
+
+/* Возвращает следующий символ, не извлекая его, или EOS в конце ввода */
+static inline char peek_char(input_t *stream) {
+	assert(stream);
+	while (true) {
+		while (stream->run != stream->end && _is_skipped(*stream->run))
+			++stream->run;
+		if (stream->run != stream->end)
+			return *stream->run;
+		if (!fill_input(stream))
+			return EOS;
+	}
+}
+
+/* Извлекает символ, уже полученный `peek_char` */
+static inline void skip_char(input_t *stream) {
+	assert(stream && stream->run != stream->end);
+	++stream->run;
+}
+
+error_t read_char(input_t *stream, char c) {
+	assert(stream);
+	if (peek_char(stream) != c)
+		return INVALID_FORMAT;
+	skip_char(stream);
+	return SUCCESS;
+}
+
+// Имена обычно короткие, а в программе их может быть много, поэтому строка начинается с
+// небольшого буфера и в конце ужимается до длины текста.
+#define TEXT_BUF_SIZE 16
+
+/* Считывает символы, пока `accept` их принимает, в новую строку с EOS в конце */
+error_t read_text(input_t *stream, bool (*accept)(char), char **text, size_t *length) {
+	assert(stream && accept && text && length);
+	size_t capacity = TEXT_BUF_SIZE;
+	*text = malloc(capacity * sizeof **text);
+	*length = 0;
+	if (!*text)
+		return ALLOC_FAILURE;
+	for (char c; (c = peek_char(stream)) != EOS && accept(c); skip_char(stream)) {
+		if (*length + 1 == capacity) {
+			char *new_text = realloc(*text, (capacity *= STD_BUF_SIZE_MULT) * sizeof **text);
+			if (!new_text)
+				return _shutdown_with_free(ALLOC_FAILURE, *text);
+			*text = new_text;
+		}
+		(*text)[(*length)++] = c;
+	}
+	(*text)[*length] = EOS;
+	char *fitted = *length + 1 < capacity ? realloc(*text, (*length + 1) * sizeof **text) : NULL;
+	if (fitted)
+		*text = fitted;
+	return SUCCESS;
 }
 
-static inline void write_char(char c) { putchar(c); }
-static inline void swrite_char(char **run, char c) {
-	assert(run && *run);
-	*(*run)++ = c;
+// ──── char ──────────────────────────────────────────────────────────────────────────────────────
+
+static inline void write_char(char c) {
+	*_reserve_output(1) = c;
+	++output_size;
 }
 
 // ──── number ────────────────────────────────────────────────────────────────────────────────────
 
-typedef int data_t;
-#define FORMAT_DATA_T "%d"
+typedef int64_t data_t;
+#define FORMAT_DATA_T "%" SCNd64
+#define DATA_T_MIN INT64_MIN
+#define DATA_T_MAX INT64_MAX
+
+// В режиме CHECKED_ARITHMETIC (включён по умолчанию) переполнение при вычислениях приводит к
+// ошибке ARITHMETIC_OVERFLOW. Переполнения не проверяются по одному: функции `*_with_flag` без
+// ветвлений накапливают в `flags` признак переполнения (знаковый бит), а вызывающий код проверяет
+// его один раз на цикл или блок координат. С -DCHECKED_ARITHMETIC=0 проверки не компилируются.
+#ifndef CHECKED_ARITHMETIC
+#define CHECKED_ARITHMETIC 1
+#endif
+
+static inline bool overflowed(data_t flags) { return CHECKED_ARITHMETIC && flags < 0; }
+
+static inline data_t add_with_flag(data_t a, data_t b, data_t *flags) {
+	const data_t c = (data_t) ((uint64_t) a + (uint64_t) b);
+	if (CHECKED_ARITHMETIC)
+		*flags |= (a ^ c) & (b ^ c);
+	return c;
+}
 
-error_t sread_number(const char **run, data_t *number, size_t skip) {
-	assert(run && *run && number);
-	if (**run == '+' || **run == '-')
-		return NOT_A_NUMBER;
-	int n_chars = 0;
-	if (sscanf(*run, FORMAT_DATA_T "%n", number, &n_chars) < 1)
+static inline data_t subtract_with_flag(data_t a, data_t b, data_t *flags) {
+	const data_t c = (data_t) ((uint64_t) a - (uint64_t) b);
+	if (CHECKED_ARITHMETIC)
+		*flags |= (a ^ b) & (a ^ c);
+	return c;
+}
+
+// Циклы над координатами обрабатывают их по SIMD_WIDTH сразу векторными расширениями GCC.
+// Признаки переполнения копятся отдельно в каждой дорожке и объединяются `_simd_or` после цикла.
+#ifdef __AVX2__
+#define SIMD_WIDTH        4
+#else
+#define SIMD_WIDTH        2  // SSE2
+#endif
+
+typedef data_t simd_t __attribute__((vector_size(SIMD_WIDTH * sizeof (data_t))));
+typedef uint64_t usimd_t __attribute__((vector_size(SIMD_WIDTH * sizeof (data_t))));  // без UB при переполнении
+
+static inline simd_t _simd_load(const data_t *p) {
+	simd_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static inline void _simd_store(data_t *p, simd_t v) { memcpy(p, &v, sizeof v); }
+
+static inline simd_t _simd_add(simd_t a, simd_t b, simd_t *flags) {
+	const simd_t c = (simd_t) ((usimd_t) a + (usimd_t) b);
+	if (CHECKED_ARITHMETIC)
+		*flags |= (a ^ c) & (b ^ c);
+	return c;
+}
+
+static inline simd_t _simd_subtract(simd_t a, simd_t b, simd_t *flags) {
+	const simd_t c = (simd_t) ((usimd_t) a - (usimd_t) b);
+	if (CHECKED_ARITHMETIC)
+		*flags |= (a ^ b) & (a ^ c);
+	return c;
+}
+
+static inline usimd_t _simd_narrow_shift(simd_t v, unsigned bits) { return (usimd_t) v + ((uint64_t) 1 << bits); }
+
+static inline data_t _simd_or(simd_t v) {
+	data_t result = 0;
+	for (size_t i = 0; i != SIMD_WIDTH; ++i)
+		result |= v[i];
+	return result;
+}
+
+/* Вспомогательная функция для `add_numbers` и `subtract_numbers`. `subtract` — константа, и    */
+/* после встраивания ветвление по ней исчезает.                                                  */
+static inline data_t _add_numbers(const data_t *restrict a, const data_t *restrict b, data_t *restrict c,
+		size_t n, size_t *n_nonzero, bool subtract) {
+	assert(n_nonzero && (!n || (a && b && c)));
+	simd_t flags = { 0 }, nonzero = { 0 };
+	data_t tail_flags = 0;
+	size_t i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		const simd_t d = subtract ? _simd_subtract(_simd_load(a + i), _simd_load(b + i), &flags)
+				: _simd_add(_simd_load(a + i), _simd_load(b + i), &flags);
+		_simd_store(c + i, d);
+		nonzero -= d != 0;  // сравнение даёт -1 в дорожках, где оно истинно
+	}
+	size_t count = 0;
+	for (; i != n; ++i)
+		count += (c[i] = subtract ? subtract_with_flag(a[i], b[i], &tail_flags)
+				: add_with_flag(a[i], b[i], &tail_flags)) != 0;
+	for (size_t j = 0; j != SIMD_WIDTH; ++j)
+		count += nonzero[j];
+	*n_nonzero = count;
+	return tail_flags | _simd_or(flags);
+}
+
+/* Записывает в `c` суммы `a[i] + b[i]`, в `*n_nonzero` — количество ненулевых из них, и          */
+/* возвращает признаки переполнения.                                                             */
+data_t add_numbers(const data_t *restrict a, const data_t *restrict b, data_t *restrict c, size_t n,
+		size_t *n_nonzero) {
+	return _add_numbers(a, b, c, n, n_nonzero, false);
+}
+
+/* То же, что `add_numbers`, для разностей `a[i] - b[i]` */
+data_t subtract_numbers(const data_t *restrict a, const data_t *restrict b, data_t *restrict c, size_t n,
+		size_t *n_nonzero) {
+	return _add_numbers(a, b, c, n, n_nonzero, true);
+}
+
+/* Число `x` лежит в [-2^bits, 2^bits), если `x + 2^bits` без знака меньше 2^(bits + 1). Такие  */
+/* суммы можно объединять по `|` и проверять сразу для блока координат.                          */
+static inline uint64_t narrow_shift(data_t x, unsigned bits) { return (uint64_t) x + ((uint64_t) 1 << bits); }
+static inline bool is_narrow(uint64_t shifted, unsigned bits) { return !(shifted >> bits >> 1); }
+
+static inline uint64_t magnitude(data_t x) { return x < 0 ? 0 - (uint64_t) x : (uint64_t) x; }
+
+/* Множители, произведение которых на фиксированное число не переполняется. Множители из        */
+/* [-2^narrow_bits, 2^narrow_bits) заведомо допустимы, отрицательное `narrow_bits` означает,     */
+/* что быстрой проверки нет.                                                                     */
+typedef struct {
+	data_t min, max;
+	int narrow_bits;
+} scale_bounds_t;
+
+scale_bounds_t scale_bounds(data_t number) {
+	if (!number)
+		return (scale_bounds_t) { DATA_T_MIN, DATA_T_MAX, 63 };
+	// |number| < 2^length, поэтому 2^(63 - length) * |number| < 2^63
+	const int narrow_bits = __builtin_clzll(magnitude(number)) - 1;
+	if (number == -1)
+		return (scale_bounds_t) { -DATA_T_MAX, DATA_T_MAX, narrow_bits };
+	if (number > 0)
+		return (scale_bounds_t) { DATA_T_MIN / number, DATA_T_MAX / number, narrow_bits };
+	return (scale_bounds_t) { DATA_T_MAX / number, DATA_T_MIN / number, narrow_bits };
+}
+
+static inline data_t scale_with_flag(data_t a, data_t number, const scale_bounds_t *bounds, data_t *flags) {
+	assert(bounds);
+	if (CHECKED_ARITHMETIC)
+		*flags |= -(data_t) ((a < bounds->min) | (a > bounds->max));
+	return (data_t) ((uint64_t) a * (uint64_t) number);
+}
+
+/* Записывает в `c` произведения `a[i] * number` и возвращает признаки переполнения. Границы     */
+/* `bounds` проверяются, только если нашлись множители вне быстрого диапазона.                   */
+data_t scale_numbers(const data_t *restrict a, data_t number, const scale_bounds_t *bounds,
+		data_t *restrict c, size_t n) {
+	assert(bounds && (!n || (a && c)));
+	data_t flags = 0;
+	if (bounds->narrow_bits < 0) {
+		for (size_t i = 0; i != n; ++i)
+			c[i] = scale_with_flag(a[i], number, bounds, &flags);
+		return flags;
+	}
+	const unsigned bits = bounds->narrow_bits;
+	usimd_t wide = { 0 };
+	uint64_t tail_wide = 0;
+	size_t i = 0;
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		const simd_t v = _simd_load(a + i);
+		if (CHECKED_ARITHMETIC)
+			wide |= _simd_narrow_shift(v, bits);
+		_simd_store(c + i, (simd_t) ((usimd_t) v * (uint64_t) number));
+	}
+	for (; i != n; ++i) {
+		if (CHECKED_ARITHMETIC)
+			tail_wide |= narrow_shift(a[i], bits);
+		c[i] = (data_t) ((uint64_t) a[i] * (uint64_t) number);
+	}
+	if (!CHECKED_ARITHMETIC)
+		return 0;
+	if (!is_narrow(tail_wide | (uint64_t) _simd_or((simd_t) wide), bits))
+		for (i = 0; i != n; ++i)
+			scale_with_flag(a[i], number, bounds, &flags);
+	return flags;
+}
+
+// "-9223372036854775808" — самое длинное десятичное представление 64-битного числа
+#define MAX_NUMBER_LENGTH 20
+
+static const char DIGIT_PAIRS[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Записывает в `dst` десятичное представление `number` (без EOS) и возвращает количество        */
+/* записанных символов. Цифры формируются парами с конца во временном буфере.                    */
+size_t format_number(char *dst, data_t number) {
+	assert(dst);
+	char buf[MAX_NUMBER_LENGTH];
+	char *end = buf + MAX_NUMBER_LENGTH;
+	char *run = end;
+	unsigned long long u = number < 0 ? 0ULL - (unsigned long long) number : (unsigned long long) number;
+	while (u >= 100) {
+		const unsigned pair = (unsigned) (u % 100) * 2;
+		u /= 100;
+		*--run = DIGIT_PAIRS[pair + 1];
+		*--run = DIGIT_PAIRS[pair];
+	}
+	if (u >= 10) {
+		*--run = DIGIT_PAIRS[u * 2 + 1];
+		*--run = DIGIT_PAIRS[u * 2];
+	}
+	else
+		*--run = (char) ('0' + u);
+	if (number < 0)
+		*--run = '-';
+	const size_t len = end - run;
+	memcpy(dst, run, len);
+	return len;
+}
+
+// Литералы хэшируются по мере разбора (FNV-1a по координатам), чтобы одинаковые литералы
+// выражения объединялись в один лист без ещё одного прохода по значению, см. `intern_node`.
+
+#define EXPR_HASH_BASIS 14695981039346656037ULL
+#define EXPR_HASH_PRIME 1099511628211ULL
+
+static inline unsigned long long _hash_step(unsigned long long hash, unsigned long long value) {
+	return (hash ^ value) * EXPR_HASH_PRIME;
+}
+
+error_t read_number(input_t *stream, data_t *number) {
+	assert(stream && number);
+	char c = peek_char(stream);
+	if (!isdigit((unsigned char) c))
 		return NOT_A_NUMBER;
-	*run += n_chars + skip;
+	uint64_t value = 0;
+	for (; isdigit((unsigned char) c); c = peek_char(stream)) {
+		const unsigned digit = c - '0';
+		if (value > ((uint64_t) DATA_T_MAX - digit) / 10)
+			return ARITHMETIC_OVERFLOW;
+		value = value * 10 + digit;
+		skip_char(stream);
+	}
+	*number = (data_t) value;
 	return SUCCESS;
 }
 
-static inline void write_number(data_t number) { printf(FORMAT_DATA_T, number); }
-static inline void write_number_with(data_t number, char c) { printf(FORMAT_DATA_T "%c", number, c); }
+static inline void write_number(data_t number) {
+	output_size += format_number(_reserve_output(MAX_NUMBER_LENGTH), number);
+}
+
+static inline void write_number_with(data_t number, char c) {
+	char *run = _reserve_output(MAX_NUMBER_LENGTH + 1);
+	run += format_number(run, number);
+	*run = c;
+	output_size = run + 1 - output_buf;
+}
+
+// ──── name ──────────────────────────────────────────────────────────────────────────────────────
+
+// Имя — это последовательность латинских букв, цифр и `_`, начинающаяся не с цифры. `name_t`
+// ссылается на текст имени, не заканчивающийся EOS.
 
-static inline void swrite_number(char **run, data_t number) {
-	assert(run && *run);
-	*run += sprintf(*run, FORMAT_DATA_T, number);
+typedef struct {
+	const char *begin;
+	size_t length;
+} name_t;
+
+static inline bool is_name_head(char c) { return isalpha((unsigned char) c) || c == '_'; }
+static inline bool is_name_tail(char c) { return isalnum((unsigned char) c) || c == '_'; }
+
+/* Считывает имя из потока. Имя копируется в новую строку, которую нужно освободить */
+error_t read_name(input_t *stream, name_t *name) {
+	assert(stream && name);
+	if (!is_name_head(peek_char(stream)))
+		return NOT_A_NAME;
+	char *text;
+	const error_t error = read_text(stream, is_name_tail, &text, &name->length);
+	name->begin = text;
+	return error;
 }
 
-void swrite_number_with(char **run, data_t number, char c) {
-	assert(run && *run);
-	swrite_number(run, number);
-	swrite_char(run, c);
+static inline bool equal_names(const name_t *a, const name_t *b) {
+	assert(a && b);
+	return a->length == b->length && !memcmp(a->begin, b->begin, a->length);
 }
 
 // ──── vector ────────────────────────────────────────────────────────────────────────────────────
@@ -113,27 +491,127 @@ void swrite_number_with(char **run, data_t number, char c) {
 #define VECTOR_CLOSE_BRACKET '}'
 #define VECTOR_SEPARATOR     ','
 
+#define MAPPED_VECTOR_OPEN_BRACKET  '<'
+#define MAPPED_VECTOR_CLOSE_BRACKET '>'
+
+// Вектор хранится либо плотно (все `dimension` координат), либо разреженно (только ненулевые
+// координаты и их номера по возрастанию). Разреженным становится вектор, у которого не больше
+// 1 / SPARSE_RATIO ненулевых координат, обратно плотным — у которого их больше 2 / SPARSE_RATIO.
+#define SPARSE_RATIO 4
+
 typedef struct {
 	size_t dimension;
-	data_t *components;
+	data_t *components;  // у разреженного вектора — только ненулевые координаты
+	size_t *indices;     // номера ненулевых координат разреженного вектора
+	size_t n_nonzero;    // количество ненулевых координат разреженного вектора
+	enum {
+		DENSE = 0,
+		SPARSE
+	} representation;
+	bool mapped;  // координаты отображены из файла и доступны только для чтения
+	size_t range_bits;  // координаты лежат в [-2^range_bits, 2^range_bits), если известно
 } vector_t;
 
+#define UNKNOWN_RANGE 64
+
 error_t create_vector(vector_t *vector, size_t dimension) {
 	assert(vector);
 	vector->dimension = dimension;
 	vector->components = NULL;
+	vector->indices = NULL;
+	vector->n_nonzero = 0;
+	vector->representation = DENSE;
+	vector->mapped = false;
+	vector->range_bits = UNKNOWN_RANGE;
 	if (dimension && !(vector->components = malloc(dimension * sizeof (data_t))))
 		return ALLOC_FAILURE;
 	return SUCCESS;
 }
 
+/* Создаёт нулевой разреженный вектор с местом под `capacity` ненулевых координат */
+error_t create_sparse_vector(vector_t *vector, size_t dimension, size_t capacity) {
+	assert(vector);
+	create_vector(vector, 0);
+	vector->dimension = dimension;
+	vector->representation = SPARSE;
+	if (!capacity)
+		return SUCCESS;
+	vector->components = malloc(capacity * sizeof (data_t));
+	vector->indices = malloc(capacity * sizeof (size_t));
+	if (!vector->components || !vector->indices)
+		return ALLOC_FAILURE;
+	return SUCCESS;
+}
+
 void delete_vector(vector_t *vector) {
 	assert(vector);
-	if (vector->dimension)
+	if (vector->mapped)
+		munmap(vector->components, vector->dimension * sizeof (data_t));
+	else {
 		free(vector->components);
+		free(vector->indices);
+	}
 	create_vector(vector, 0);
 }
 
+static inline error_t _shutdown_with_delete_vector(error_t error, vector_t *vector) {
+	assert(vector);
+	delete_vector(vector);
+	return error;
+}
+
+error_t sparsify_vector(vector_t *vector, size_t n_nonzero) {
+	assert(vector && vector->representation == DENSE && !vector->mapped);
+	vector_t sparse;
+	if (create_sparse_vector(&sparse, vector->dimension, n_nonzero) != SUCCESS)
+		return _shutdown_with_delete_vector(ALLOC_FAILURE, &sparse);
+	for (size_t i = 0; i != vector->dimension; ++i)
+		if (vector->components[i]) {
+			sparse.indices[sparse.n_nonzero] = i;
+			sparse.components[sparse.n_nonzero++] = vector->components[i];
+		}
+	assert(sparse.n_nonzero == n_nonzero);
+	delete_vector(vector);
+	*vector = sparse;
+	return SUCCESS;
+}
+
+error_t densify_vector(vector_t *vector) {
+	assert(vector && vector->representation == SPARSE);
+	vector_t dense;
+	if (create_vector(&dense, vector->dimension) != SUCCESS)
+		return ALLOC_FAILURE;
+	memset(dense.components, 0, dense.dimension * sizeof (data_t));
+	for (size_t k = 0; k != vector->n_nonzero; ++k)
+		dense.components[vector->indices[k]] = vector->components[k];
+	delete_vector(vector);
+	*vector = dense;
+	return SUCCESS;
+}
+
+/* Выбирает представление вектора по количеству ненулевых координат. При нехватке памяти вектор */
+/* остаётся в прежнем представлении.                                                             */
+void adjust_representation(vector_t *vector, size_t n_nonzero) {
+	assert(vector);
+	if (vector->mapped)
+		return;
+	if (vector->representation == DENSE && n_nonzero * SPARSE_RATIO <= vector->dimension)
+		sparsify_vector(vector, n_nonzero);
+	else if (vector->representation == SPARSE && n_nonzero * SPARSE_RATIO > 2 * vector->dimension)
+		densify_vector(vector);
+}
+
+/* Возвращает `i`-ю координату при последовательном обходе вектора. `*k` — номер следующей       */
+/* ненулевой координаты разреженного вектора, перед обходом он должен быть равен нулю.           */
+static inline data_t _next_component(const vector_t *vector, size_t i, size_t *k) {
+	assert(vector && k);
+	if (vector->representation == DENSE)
+		return vector->components[i];
+	if (*k != vector->n_nonzero && vector->indices[*k] == i)
+		return vector->components[(*k)++];
+	return 0;
+}
+
 error_t resize_vector(vector_t *vector, size_t new_dimension) {
 	assert(vector);
 	data_t *new_components = realloc(vector->components, new_dimension * sizeof (data_t));
@@ -156,55 +634,116 @@ static inline error_t fit_vector(vector_t *vector, size_t dimension) {
 	return resize_vector(vector, dimension);
 }
 
-static inline error_t _shutdown_with_delete_vector(error_t error, vector_t *vector) {
-	assert(vector);
-	delete_vector(vector);
-	return error;
-}
-
-error_t sread_vector(const char **run, vector_t *vector, size_t skip) {
-	assert(run && *run && vector);
-	if (sread_char(run, VECTOR_OPEN_BRACKET, 0) != SUCCESS)
+/* Считывает `{...}` и записывает в `hash` хэш координат */
+error_t read_vector(input_t *stream, vector_t *vector, unsigned long long *hash) {
+	assert(stream && vector && hash);
+	if (read_char(stream, VECTOR_OPEN_BRACKET) != SUCCESS)
 		return NOT_A_VECTOR;
+	*hash = EXPR_HASH_BASIS;
 	size_t i = 0;
-	while (**run) {
+	size_t n_nonzero = 0;
+	uint64_t range = 0;
+	while (true) {
 		data_t number;
-		if (sread_number(run, &number, 0) != SUCCESS)
-			return _shutdown_with_delete_vector(INVALID_FORMAT, vector);
-		if (i == vector->dimension && expand_vector(vector) != SUCCESS)
-			return ALLOC_FAILURE;
+		error_t error = read_number(stream, &number);
+		if (error == SUCCESS && i == vector->dimension)
+			error = expand_vector(vector);
+		if (error != SUCCESS)
+			return _shutdown_with_delete_vector(error == NOT_A_NUMBER ? INVALID_FORMAT : error, vector);
 		vector->components[i++] = number;
-		if (sread_char(run, VECTOR_CLOSE_BRACKET, 0) == SUCCESS)
+		*hash = _hash_step(*hash, (unsigned long long) number);
+		n_nonzero += number != 0;
+		range |= (uint64_t) (number ^ (number >> (sizeof (data_t) * 8 - 1)));
+		if (read_char(stream, VECTOR_CLOSE_BRACKET) == SUCCESS)
 			break;
-		if (sread_char(run, VECTOR_SEPARATOR, 0) != SUCCESS)
+		if (read_char(stream, VECTOR_SEPARATOR) != SUCCESS)
 			return _shutdown_with_delete_vector(INVALID_FORMAT, vector);
 	}
 	if (i < MIN_VECTOR_DIMENSION)
 		return _shutdown_with_delete_vector(INVALID_FORMAT, vector);
-	_skip(run, skip);
-	return fit_vector(vector, i);
+	const error_t error = fit_vector(vector, i);
+	if (error != SUCCESS)
+		return _shutdown_with_delete_vector(error, vector);
+	adjust_representation(vector, n_nonzero);
+	vector->range_bits = bit_length(range);
+	return SUCCESS;
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "mapped vectors require little-endian data_t"
+#endif
+
+/* Отображает в память файл `path` с упакованными координатами */
+error_t map_vector(const name_t *path, vector_t *vector) {
+	assert(path && vector);
+	char *filename = malloc((path->length + 1) * sizeof *filename);
+	if (!filename)
+		return ALLOC_FAILURE;
+	memcpy(filename, path->begin, path->length);
+	filename[path->length] = EOS;
+	const int fd = open(filename, O_RDONLY);
+	free(filename);
+	if (fd < 0)
+		return IO_FAILURE;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size % sizeof (data_t)
+			|| (size_t) st.st_size / sizeof (data_t) < MIN_VECTOR_DIMENSION) {
+		close(fd);
+		return INVALID_FORMAT;
+	}
+	void *components = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (components == MAP_FAILED)
+		return IO_FAILURE;
+	madvise(components, st.st_size, MADV_SEQUENTIAL);
+	vector->dimension = st.st_size / sizeof (data_t);
+	vector->components = components;
+	vector->mapped = true;
+	return SUCCESS;
+}
+
+static inline bool _is_path_char(char c) { return c != MAPPED_VECTOR_CLOSE_BRACKET; }
+
+/* Считывает `<path>` и отображает файл в память. Пробелы внутри скобок пропускаются */
+error_t read_mapped_vector(input_t *stream, vector_t *vector) {
+	assert(stream && vector);
+	if (read_char(stream, MAPPED_VECTOR_OPEN_BRACKET) != SUCCESS)
+		return NOT_A_PATH;
+	char *text;
+	name_t path;
+	error_t error = read_text(stream, _is_path_char, &text, &path.length);
+	if (error != SUCCESS)
+		return error;
+	path.begin = text;
+	if (!path.length || read_char(stream, MAPPED_VECTOR_CLOSE_BRACKET) != SUCCESS)
+		error = INVALID_FORMAT;
+	else
+		error = map_vector(&path, vector);
+	return _shutdown_with_free(error, text);
 }
 
 void write_vector(const vector_t *vector) {
 	assert(vector);
+	size_t k = 0;
 	write_char(VECTOR_OPEN_BRACKET);
 	for (size_t i = 0; i + 1 < vector->dimension; ++i)
-		write_number_with(vector->components[i], VECTOR_SEPARATOR);
-	write_number_with(vector->components[vector->dimension - 1], VECTOR_CLOSE_BRACKET);
+		write_number_with(_next_component(vector, i, &k), VECTOR_SEPARATOR);
+	write_number_with(_next_component(vector, vector->dimension - 1, &k), VECTOR_CLOSE_BRACKET);
 }
 
-void swrite_vector(char **run, const vector_t *vector) {
-	assert(run && *run && vector);
-	swrite_char(run, VECTOR_OPEN_BRACKET);
-	for (size_t i = 0; i + 1 < vector->dimension; ++i)
-		swrite_number_with(run, vector->components[i], VECTOR_SEPARATOR);
-	swrite_number_with(run, vector->components[vector->dimension - 1], VECTOR_CLOSE_BRACKET);
-}
-
-void swrite_vector_with(char **run, const vector_t *vector, char c) {
-	assert(run && *run && vector);
-	swrite_vector(run, vector);
-	swrite_char(run, c);
+/* Записывает координаты в stdout в том же формате, что и у файлов `<path>` */
+bool write_vector_binary(const vector_t *vector) {
+	assert(vector);
+	if (vector->representation == DENSE)
+		return flush_output() && _write_all(vector->components, vector->dimension * sizeof (data_t));
+	size_t k = 0;
+	for (size_t i = 0; i != vector->dimension; ++i) {
+		const data_t component = _next_component(vector, i, &k);
+		memcpy(_reserve_output(sizeof component), &component, sizeof component);
+		output_size += sizeof component;
+	}
+	return flush_output();
 }
 
 /* Вспомогательная функция для `_add_vectors`. Определяет максимальную и минимальную размерность */
@@ -229,48 +768,152 @@ const data_t *max_min_dim(
 }
 
 #pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"    // for this
-
-typedef data_t (*add_ft)(data_t, data_t);              //   │
-data_t base_add(data_t a, data_t b) { return a + b; }  //   │
-data_t base_sub(data_t a, data_t b) { return a - b; }  //   │
-data_t tail_add(data_t sign, data_t d) { return d; }   // ◄─┘
-data_t tail_sub(data_t sign, data_t d) { return sign * d; }
+#pragma GCC diagnostic ignored "-Wunused-parameter"                                             // for this
+
+typedef data_t (*add_ft)(data_t, data_t, data_t *);                                             //   │
+data_t base_add(data_t a, data_t b, data_t *flags) { return add_with_flag(a, b, flags); }       //   │
+data_t base_sub(data_t a, data_t b, data_t *flags) { return subtract_with_flag(a, b, flags); }  //   │
+data_t tail_add(data_t sign, data_t d, data_t *flags) { return d; }                             // ◄─┘
+data_t tail_sub(data_t sign, data_t d, data_t *flags) {
+	return sign < 0 ? subtract_with_flag(0, d, flags) : d;
+}
 
 #pragma GCC diagnostic pop
 
+typedef data_t (*add_numbers_ft)(const data_t *, const data_t *, data_t *, size_t, size_t *);
+
+// Записи вектора при слиянии: у разреженного — ненулевые координаты, у плотного — все
+static inline size_t _n_entries(const vector_t *vector) {
+	return vector->representation == DENSE ? vector->dimension : vector->n_nonzero;
+}
+
+static inline size_t _entry_index(const vector_t *vector, size_t k) {
+	return vector->representation == DENSE ? k : vector->indices[k];
+}
+
+/* Вспомогательная функция для `_add_vectors`. Складывает или вычитает вектора слиянием списков  */
+/* их записей в разреженный результат.                                                           */
+error_t _merge_vectors(const vector_t *a, const vector_t *b, vector_t *c, add_ft base) {
+	assert(a && b && c && base);
+	const size_t dimension = maxlu(a->dimension, b->dimension);
+	const size_t n_a = _n_entries(a), n_b = _n_entries(b);
+	if (create_sparse_vector(c, dimension, n_a + n_b) != SUCCESS)
+		return _shutdown_with_delete_vector(ALLOC_FAILURE, c);
+	size_t i = 0, j = 0;
+	data_t flags = 0;
+	while (i != n_a || j != n_b) {
+		const size_t index_a = i != n_a ? _entry_index(a, i) : SIZE_MAX;
+		const size_t index_b = j != n_b ? _entry_index(b, j) : SIZE_MAX;
+		const size_t index = minlu(index_a, index_b);
+		const data_t d = base(
+				index_a == index ? a->components[i++] : 0,
+				index_b == index ? b->components[j++] : 0, &flags);
+		if (d) {
+			c->indices[c->n_nonzero] = index;
+			c->components[c->n_nonzero++] = d;
+		}
+	}
+	if (overflowed(flags))
+		return _shutdown_with_delete_vector(ARITHMETIC_OVERFLOW, c);
+	adjust_representation(c, c->n_nonzero);
+	return SUCCESS;
+}
+
+/* Вспомогательная функция для `_add_vectors`. Складывает или вычитает плотный и разреженный     */
+/* вектора в плотный результат: в него переносится плотный, затем к нему применяются ненулевые   */
+/* координаты разреженного. Потом представление выбирается по числу ненулевых координат.         */
+error_t _add_mixed_vectors(const vector_t *a, const vector_t *b, vector_t *c, add_ft base) {
+	assert(a && b && c && base);
+	if (create_vector(c, maxlu(a->dimension, b->dimension)) != SUCCESS)
+		return ALLOC_FAILURE;
+	size_t n_nonzero = 0;
+	data_t flags = 0;
+	if (a->representation == DENSE) {
+		for (size_t i = 0; i != a->dimension; ++i)
+			n_nonzero += (c->components[i] = a->components[i]) != 0;
+		memset(c->components + a->dimension, 0, (c->dimension - a->dimension) * sizeof (data_t));
+		for (size_t k = 0; k != b->n_nonzero; ++k) {
+			data_t *d = &c->components[b->indices[k]];
+			n_nonzero -= *d != 0;
+			n_nonzero += (*d = base(*d, b->components[k], &flags)) != 0;
+		}
+	}
+	else {
+		for (size_t i = 0; i != b->dimension; ++i)
+			n_nonzero += (c->components[i] = base(0, b->components[i], &flags)) != 0;
+		memset(c->components + b->dimension, 0, (c->dimension - b->dimension) * sizeof (data_t));
+		for (size_t k = 0; k != a->n_nonzero; ++k) {
+			const size_t index = a->indices[k];
+			data_t *d = &c->components[index];
+			n_nonzero -= *d != 0;
+			n_nonzero += (*d = base(
+					a->components[k], index < b->dimension ? b->components[index] : 0, &flags)) != 0;
+		}
+	}
+	if (overflowed(flags))
+		return _shutdown_with_delete_vector(ARITHMETIC_OVERFLOW, c);
+	adjust_representation(c, n_nonzero);
+	return SUCCESS;
+}
+
 /* Складывает или вычитает вектора */
-error_t _add_vectors(const vector_t *a, const vector_t *b, vector_t *c, add_ft base, add_ft tail) {
-	assert(a && b && c && base && tail);
+error_t _add_vectors(const vector_t *a, const vector_t *b, vector_t *c, add_ft base, add_ft tail,
+		add_numbers_ft numbers) {
+	assert(a && b && c && base && tail && numbers);
+	// результат сразу разреженный, если ненулевых координат в нём заведомо мало, например когда
+	// разреженный вектор длиннее короткого плотного; плотный выделяется, только если их может
+	// оказаться много
+	const bool is_sparse_a = a->representation == SPARSE, is_sparse_b = b->representation == SPARSE;
+	if ((is_sparse_a && is_sparse_b) || ((is_sparse_a || is_sparse_b)
+			&& (_n_entries(a) + _n_entries(b)) * SPARSE_RATIO <= maxlu(a->dimension, b->dimension)))
+		return _merge_vectors(a, b, c, base);
+	if (is_sparse_a || is_sparse_b)
+		return _add_mixed_vectors(a, b, c, base);
+
 	size_t max_dimension, min_dimension;
 	const data_t *components_of_max;
 	data_t sign;
 	components_of_max = max_min_dim(a, b, &max_dimension, &min_dimension, &sign);
 	if (create_vector(c, max_dimension) != SUCCESS)
 		return ALLOC_FAILURE;
-	for (size_t i = 0; i != min_dimension; ++i)
-		c->components[i] = base(a->components[i], b->components[i]);
+	size_t n_nonzero;
+	data_t flags = numbers(a->components, b->components, c->components, min_dimension, &n_nonzero);
 	for (size_t i = min_dimension; i != max_dimension; ++i)
-		c->components[i] = tail(sign, components_of_max[i]);
+		n_nonzero += (c->components[i] = tail(sign, components_of_max[i], &flags)) != 0;
+	if (overflowed(flags))
+		return _shutdown_with_delete_vector(ARITHMETIC_OVERFLOW, c);
+	adjust_representation(c, n_nonzero);
 	return SUCCESS;
 }
 
 static inline error_t add_vectors(const vector_t *a, const vector_t *b, vector_t *c) {
 	assert(a && b && c);
-	return _add_vectors(a, b, c, base_add, tail_add);
+	return _add_vectors(a, b, c, base_add, tail_add, add_numbers);
 }
 
 static inline error_t subtract_vectors(const vector_t *a, const vector_t *b, vector_t *c) {
 	assert(a && b && c);
-	return _add_vectors(a, b, c, base_sub, tail_sub);
+	return _add_vectors(a, b, c, base_sub, tail_sub, subtract_numbers);
 }
 
 error_t multiply_vector(data_t number, const vector_t *vector, vector_t *result) {
 	assert(vector && result);
-	if (create_vector(result, vector->dimension) != SUCCESS)
+	if (!number)
+		return create_sparse_vector(result, vector->dimension, 0);
+	const scale_bounds_t bounds = scale_bounds(number);
+	if (vector->representation == SPARSE) {
+		if (create_sparse_vector(result, vector->dimension, vector->n_nonzero) != SUCCESS)
+			return _shutdown_with_delete_vector(ALLOC_FAILURE, result);
+		result->n_nonzero = vector->n_nonzero;
+		for (size_t k = 0; k != result->n_nonzero; ++k)
+			result->indices[k] = vector->indices[k];
+	}
+	else if (create_vector(result, vector->dimension) != SUCCESS)
 		return ALLOC_FAILURE;
-	for (size_t i = 0; i != result->dimension; ++i)
-		result->components[i] = vector->components[i] * number;
+	const size_t n = vector->representation == SPARSE ? vector->n_nonzero : vector->dimension;
+	const data_t flags = scale_numbers(vector->components, number, &bounds, result->components, n);
+	if (overflowed(flags))
+		return _shutdown_with_delete_vector(ARITHMETIC_OVERFLOW, result);
 	return SUCCESS;
 }
 
@@ -349,31 +992,42 @@ void init_operand(operand_t *operand) {
 	create_vector(&operand->vector, 0);
 }
 
-error_t sread_operand(const char **run, operand_t *operand, size_t skip) {
-	assert(run && *run && operand);
+/* Считывает операнд и записывает в `hash` хэш его значения. У отображённых векторов хэш */
+/* только по виду операнда: они не объединяются.                                          */
+error_t read_operand(input_t *stream, operand_t *operand, unsigned long long *hash) {
+	assert(stream && operand && hash);
 	init_operand(operand);
-	if (sread_number(run, &operand->number, skip) == SUCCESS) {
+	error_t error = read_number(stream, &operand->number);
+	if (error != NOT_A_NUMBER) {
 		operand->type = NUMBER;
-		return SUCCESS;
+		*hash = _hash_step(EXPR_HASH_BASIS, (unsigned long long) operand->number);
+		return error;  // SUCCESS or ARITHMETIC_OVERFLOW
 	}
-	error_t error = sread_vector(run, &operand->vector, skip);
+	*hash = EXPR_HASH_BASIS;
+	if ((error = read_mapped_vector(stream, &operand->vector)) != NOT_A_PATH)
+		return error;  // SUCCESS, ALLOC_FAILURE, IO_FAILURE or INVALID_FORMAT
+	error = read_vector(stream, &operand->vector, hash);
 	if (error == NOT_A_VECTOR)
 		return NOT_AN_OPERAND;
-	return error;  // SUCCESS, ALLOC_FAILURE or INVALID_FORMAT
+	return error;  // SUCCESS, ALLOC_FAILURE, ARITHMETIC_OVERFLOW or INVALID_FORMAT
 }
 
-void swrite_operand_with(char **run, const operand_t *operand, char c) {
-	assert(run && *run && operand);
-	switch (operand->type) {
-	case NUMBER:
-		swrite_number_with(run, operand->number, c);
-		return;
-	case VECTOR:
-		swrite_vector_with(run, &operand->vector, c);
-		return;
-	default:
-		assert(0);
-	}
+void write_operand(const operand_t *operand) {
+	assert(operand);
+	if (operand->type == NUMBER)
+		write_number(operand->number);
+	else
+		write_vector(&operand->vector);
+}
+
+/* Число записывается одной упакованной координатой */
+bool write_operand_binary(const operand_t *operand) {
+	assert(operand);
+	if (operand->type == VECTOR)
+		return write_vector_binary(&operand->vector);
+	memcpy(_reserve_output(sizeof operand->number), &operand->number, sizeof operand->number);
+	output_size += sizeof operand->number;
+	return flush_output();
 }
 
 void delete_operand(operand_t *operand) {
@@ -390,170 +1044,774 @@ static inline error_t _shutdown_with_delete_operand(error_t error, operand_t *op
 
 // ──── operator ──────────────────────────────────────────────────────────────────────────────────
 
-#define OPEN_BRACKET_SYMB  '('
-#define CLOSE_BRACKET_SYMB ')'
-#define PLUS_SYMB          '+'
-#define MINUS_SYMB         '-'
-#define MULTIPLY_SYMB      '*'
+#define OPEN_BRACKET_SYMB       '('
+#define CLOSE_BRACKET_SYMB      ')'
+#define ARGUMENT_SEPARATOR_SYMB ','
+#define PLUS_SYMB               '+'
+#define MINUS_SYMB              '-'
+#define MULTIPLY_SYMB           '*'
 
+// Редукции записываются как вызовы функций (`dot(a, b)`, `sum(a)`, ...), их имя считывается
+// вместе с открывающей скобкой.
 typedef enum {
 	OPEN_BRACKET,
+	SECOND_ARGUMENT_BRACKET,  // скобка вызова, после которой уже была запятая
 	CLOSE_BRACKET,
+	ARGUMENT_SEPARATOR,
 	PLUS,
 	MINUS,
 	MULTIPLY,
+	DOT,
+	SUM,
+	MIN,
+	MAX,
+	L1,
+	L2SQ,
 } operator_t;
 
-error_t sread_operator(const char **run, operator_t *operator, size_t skip) {
-	assert(run && *run && operator);
-	if (sread_char(run, OPEN_BRACKET_SYMB, skip) == SUCCESS)
+static const char *const FUNCTION_NAMES[] = {
+	[DOT]  = "dot",
+	[SUM]  = "sum",
+	[MIN]  = "min",
+	[MAX]  = "max",
+	[L1]   = "l1",
+	[L2SQ] = "l2sq",
+};
+
+static inline bool is_reduction(operator_t operator) { return operator >= DOT; }
+static inline bool is_bracket(operator_t operator) { return operator == OPEN_BRACKET || operator == SECOND_ARGUMENT_BRACKET; }
+static inline bool is_elementwise(operator_t operator) { return operator >= PLUS && operator <= MULTIPLY; }
+static inline size_t arity(operator_t operator) { return is_reduction(operator) && operator != DOT ? 1 : 2; }
+
+/* Приоритет поэлементных операций, у остальных операторов он нулевой */
+static inline int precedence(operator_t operator) {
+	switch (operator) {
+	case PLUS:
+	case MINUS:
+		return 1;
+	case MULTIPLY:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* Считывает оператор, кроме функций: их имена считываются как имена */
+error_t read_operator(input_t *stream, operator_t *operator) {
+	assert(stream && operator);
+	switch (peek_char(stream)) {
+	case OPEN_BRACKET_SYMB:
 		*operator = OPEN_BRACKET;
-	else if (sread_char(run, CLOSE_BRACKET_SYMB, skip) == SUCCESS)
+		break;
+	case CLOSE_BRACKET_SYMB:
 		*operator = CLOSE_BRACKET;
-	else if (sread_char(run, PLUS_SYMB, skip) == SUCCESS)
+		break;
+	case ARGUMENT_SEPARATOR_SYMB:
+		*operator = ARGUMENT_SEPARATOR;
+		break;
+	case PLUS_SYMB:
 		*operator = PLUS;
-	else if (sread_char(run, MINUS_SYMB, skip) == SUCCESS)
+		break;
+	case MINUS_SYMB:
 		*operator = MINUS;
-	else if (sread_char(run, MULTIPLY_SYMB, skip) == SUCCESS)
+		break;
+	case MULTIPLY_SYMB:
 		*operator = MULTIPLY;
-	else
+		break;
+	default:
 		return NOT_AN_OPERATOR;
+	}
+	skip_char(stream);
 	return SUCCESS;
 }
 
-char symb(operator_t operator) {
-	switch (operator) {
-	case OPEN_BRACKET:
-		return OPEN_BRACKET_SYMB;
-	case CLOSE_BRACKET:
-		return CLOSE_BRACKET_SYMB;
-	case PLUS:
-		return PLUS_SYMB;
-	case MINUS:
-		return MINUS_SYMB;
-	case MULTIPLY:
-		return MULTIPLY_SYMB;
-	default:
-		return EOS;
-	}
+/* Находит функцию с именем `name` */
+error_t find_function(const name_t *name, operator_t *operator) {
+	assert(name && operator);
+	for (operator_t function = DOT; function <= L2SQ; ++function)
+		if (strlen(FUNCTION_NAMES[function]) == name->length
+				&& !memcmp(FUNCTION_NAMES[function], name->begin, name->length)) {
+			*operator = function;
+			return SUCCESS;
+		}
+	return NOT_AN_OPERATOR;
 }
 
-static inline void swrite_operator(char **run, operator_t operator) {
-	assert(run && *run);
-	swrite_char(run, symb(operator));
-}
+// ──── kernel ────────────────────────────────────────────────────────────────────────────────────
 
-void swrite_operator_with(char **run, operator_t operator, char c) {
-	assert(run && *run);
-	swrite_operator(run, operator);
-	swrite_char(run, c);
-}
+// Ядро — это программа из поэлементных шагов над векторами, результат которой сворачивается
+// редукцией. Ядро вычисляется блоками по KERNEL_BLOCK_SIZE координат: для каждого блока шаги
+// вычисляются во временные буферы, затем блок сворачивается SIMD-циклом. Так поэлементные
+// операции, результат которых нужен только редукции, никогда не материализуются целиком.
 
-// ──── algorithm ─────────────────────────────────────────────────────────────────────────────────
+#define KERNEL_BLOCK_SIZE 256
 
-#define POSTFIX_EXPR_SEPARATOR WHITESPACE
+typedef struct {
+	enum {
+		LOAD = 0,
+		ADD,
+		SUBTRACT,
+		SCALE
+	} kind;
+	const vector_t *vector;  // LOAD: загружаемый вектор
+	size_t k;                // LOAD: номер следующей ненулевой координаты разреженного вектора
+	data_t number;           // SCALE: множитель
+	scale_bounds_t bounds;   // SCALE: множители без переполнения
+	size_t a, b;             // номера шагов-аргументов
+	size_t dimension;
+	size_t bits;             // значения шага лежат в [-2^bits, 2^bits)
+	data_t *buf;
+	void *typed_buf;         // буфер специализаций, см. DEFINE_TYPED_KERNEL
+	const void *out;         // результат шага для текущего блока
+} kernel_step_t;
 
-/* Следующие вспомогательные функции вынимают из стека не указатель на значение, а само значение */
-operand_t pop_operand(stack_node_t **operands) {                                              /* */
-	assert(operands && *operands);
-	operand_t *p_operand = pop(operands);
-	operand_t operand = *p_operand;
-	free(p_operand);
-	return operand;
-}
+#define KERNEL_BUF_SIZE (KERNEL_BLOCK_SIZE * (sizeof (data_t) + sizeof (__int128)))
 
-operator_t pop_operator(stack_node_t **operators) {                                           /* */
-	assert(operators && *operators);
-	operator_t *p_operator = pop(operators);
-	operator_t operator = *p_operator;
-	free(p_operator);
-	return operator;
+typedef struct {
+	kernel_step_t *steps;
+	size_t n_steps;
+	char *bufs;
+} kernel_t;
+
+error_t create_kernel(kernel_t *kernel, size_t max_steps) {
+	assert(kernel && max_steps);
+	kernel->n_steps = 0;
+	kernel->steps = malloc(max_steps * sizeof *kernel->steps);
+	kernel->bufs = malloc(max_steps * KERNEL_BUF_SIZE);
+	if (!kernel->steps || !kernel->bufs) {
+		free(kernel->steps);
+		free(kernel->bufs);
+		return ALLOC_FAILURE;
+	}
+	return SUCCESS;
 }
 
-/* Вспомогательная функция для `shunting yard`. Освобождает выделенную внутри функции память. По */
-/* сути это _shutdown_with_delete_stack_and_free.                                                */
-error_t _shutdown_shunting_yard(error_t error, stack_node_t **stack, char *expr) {
-	assert(stack && expr);
-	delete_stack(stack);
-	free(expr);
-	return error;
+void delete_kernel(kernel_t *kernel) {
+	assert(kernel);
+	free(kernel->steps);
+	free(kernel->bufs);
+	kernel->steps = NULL;
+	kernel->bufs = NULL;
+	kernel->n_steps = 0;
 }
 
-/* Вспомогательная функция для `shunting_yard`. Кладёт, в соответствии с алгоритмом, оператор    */
-/* в стэк, в случае ошибки удаляет его (стэк).                                                   */
-error_t handle_push_operator_error(stack_node_t **operators, operator_t operator, char **run) {
-	assert(operators && run && *run);
-	if (operator == OPEN_BRACKET)
-		return handle_push_error(operators, &operator, sizeof operator);
-	if (operator == CLOSE_BRACKET) {
-		while (true) {
-			if (!*operators)
-				return INVALID_FORMAT;
-			if ((operator = pop_operator(operators)) == OPEN_BRACKET)
-				break;
-			swrite_operator_with(run, operator, POSTFIX_EXPR_SEPARATOR);
-		}
-		return SUCCESS;
+/* Добавляет шаг в ядро и возвращает его номер. Место под шаг должно быть выделено заранее */
+size_t add_kernel_step(kernel_t *kernel, const kernel_step_t *step) {
+	assert(kernel && step);
+	kernel_step_t *new_step = kernel->steps + kernel->n_steps;
+	*new_step = *step;
+	new_step->k = 0;
+	new_step->buf = (data_t *) (kernel->bufs + kernel->n_steps * KERNEL_BUF_SIZE);
+	new_step->typed_buf = new_step->buf + KERNEL_BLOCK_SIZE;
+	if (step->kind == LOAD) {
+		new_step->dimension = step->vector->dimension;
+		new_step->bits = step->vector->range_bits;
 	}
-	                       // priority
-	if (*operators && operator <= *(operator_t *) top(*operators))
-		swrite_operator_with(run, pop_operator(operators), POSTFIX_EXPR_SEPARATOR);
-	return handle_push_error(operators, &operator, sizeof operator);
+	else if (step->kind == SCALE) {
+		new_step->dimension = kernel->steps[step->a].dimension;
+		new_step->bounds = scale_bounds(step->number);
+		new_step->bits = kernel->steps[step->a].bits + bit_length(magnitude(step->number));
+	}
+	else {
+		new_step->dimension = maxlu(kernel->steps[step->a].dimension, kernel->steps[step->b].dimension);
+		new_step->bits = maxlu(kernel->steps[step->a].bits, kernel->steps[step->b].bits) + 1;
+	}
+	return kernel->n_steps++;
 }
 
-error_t shunting_yard(const char *infix_expr, char **postfix_expr) {
-	assert(infix_expr && postfix_expr && strlen(infix_expr));
-	*postfix_expr = malloc((2 * strlen(infix_expr) + 1) * sizeof (char));
-	if (!*postfix_expr)
-		return ALLOC_FAILURE;
-	const char *run_infix = infix_expr;
-	char *run_postfix = *postfix_expr;
-	stack_node_t *operators = NULL;
-	while (*run_infix) {
-		// maybe it's an operand ?
-		operand_t operand;
-		error_t error = sread_operand(&run_infix, &operand, 0);
-		if (error == SUCCESS) {
-			swrite_operand_with(&run_postfix, &operand, POSTFIX_EXPR_SEPARATOR);
-			delete_operand(&operand);
-			continue;
-		}
-		else if (error != NOT_AN_OPERAND)  // ALLOC_FAILURE or INVALID_FORMAT
-			return _shutdown_shunting_yard(error, &operators, *postfix_expr);
-
-		// okay, it must be an operator
-		operator_t operator;
-		if (sread_operator(&run_infix, &operator, 0) != SUCCESS)
-			return _shutdown_shunting_yard(INVALID_FORMAT, &operators, *postfix_expr);
-		if ((error = handle_push_operator_error(&operators, operator, &run_postfix)) != SUCCESS)
-			return _shutdown_with_free(error, *postfix_expr);
+/* Загружает координаты [begin, begin + n) вектора. Координаты за пределами размерности нулевые */
+void _load_block(kernel_step_t *step, size_t begin, size_t n) {
+	assert(step && n <= KERNEL_BLOCK_SIZE);
+	const vector_t *vector = step->vector;
+	if (vector->representation == SPARSE) {
+		memset(step->buf, 0, n * sizeof (data_t));
+		for (; step->k != vector->n_nonzero && vector->indices[step->k] < begin + n; ++step->k)
+			step->buf[vector->indices[step->k] - begin] = vector->components[step->k];
+		step->out = step->buf;
 	}
-	while (operators) {
-		const operator_t operator = pop_operator(&operators);
-		if (operator == OPEN_BRACKET)
-			return _shutdown_shunting_yard(INVALID_FORMAT, &operators, *postfix_expr);
-		swrite_operator_with(&run_postfix, operator, POSTFIX_EXPR_SEPARATOR);
+	else if (begin + n <= vector->dimension)
+		step->out = vector->components + begin;  // без копирования
+	else {
+		const size_t available = begin < vector->dimension ? vector->dimension - begin : 0;
+		memcpy(step->buf, vector->components + begin, available * sizeof (data_t));
+		memset(step->buf + available, 0, (n - available) * sizeof (data_t));
+		step->out = step->buf;
 	}
-	*run_postfix = EOS;
-	return SUCCESS;
 }
 
-/* `_add_operands`, по аналогии с `_add_vectors`, складывает или вычитает операнды               */
-typedef error_t (*add_vectors_ft)(const vector_t *, const vector_t *, vector_t *);
-error_t _add_operands(const operand_t *a, const operand_t *b, operand_t *c, add_vectors_ft _add) {
-	assert(a && b && c && _add);
-	if (a->type == VECTOR && b->type == VECTOR)
-		return _add(&a->vector, &b->vector, &c->vector);
-	return INVALID_FORMAT;
-}
+static inline data_t absd(data_t a) { return a < 0 ? (data_t) (0 - (uint64_t) a) : a; }
+static inline data_t multiplyd(data_t a, data_t b) { return (data_t) ((uint64_t) a * (uint64_t) b); }
 
-static inline error_t add_operands(const operand_t *a, const operand_t *b, operand_t *c) {
-	assert(a && b && c);
-	return _add_operands(a, b, c, &add_vectors);
+static inline simd_t _simd_select(simd_t mask, simd_t a, simd_t b) { return (a & mask) | (b & ~mask); }
+static inline simd_t _simd_multiply(simd_t a, simd_t b) { return (simd_t) ((usimd_t) a * (usimd_t) b); }
+
+/* Модуль DATA_T_MIN остаётся отрицательным, что и служит признаком переполнения */
+static inline simd_t _simd_abs(simd_t v) {
+	const simd_t sign = v >> (sizeof (data_t) * 8 - 1);
+	return (simd_t) ((usimd_t) (v ^ sign) - (usimd_t) sign);
 }
 
-static inline error_t subtract_operands(const operand_t *a, const operand_t *b, operand_t *c) {
-	assert(a && b && c);
+/* Вспомогательная функция для `run_kernel_block`. Вычисляет шаг ядра для блока из `n` координат */
+/* и возвращает признаки переполнения.                                                           */
+data_t _run_step_block(const kernel_step_t *step, const data_t *restrict a, const data_t *restrict b,
+		data_t *restrict c, size_t n) {
+	assert(step && a && c && (b || step->kind == SCALE));
+	simd_t flags = { 0 };
+	data_t tail_flags = 0;
+	size_t i = 0;
+	switch (step->kind) {
+	case ADD:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+			_simd_store(c + i, _simd_add(_simd_load(a + i), _simd_load(b + i), &flags));
+		for (; i != n; ++i)
+			c[i] = add_with_flag(a[i], b[i], &tail_flags);
+		break;
+	case SUBTRACT:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+			_simd_store(c + i, _simd_subtract(_simd_load(a + i), _simd_load(b + i), &flags));
+		for (; i != n; ++i)
+			c[i] = subtract_with_flag(a[i], b[i], &tail_flags);
+		break;
+	case SCALE:
+		return scale_numbers(a, step->number, &step->bounds, c, n);
+	default:
+		assert(0);
+	}
+	return tail_flags | _simd_or(flags);
+}
+
+/* Вычисляет все шаги ядра для блока из `n` координат, загруженного `load_kernel_block` */
+error_t run_kernel_block(kernel_t *kernel, size_t n) {
+	assert(kernel);
+	data_t flags = 0;
+	for (size_t s = 0; s != kernel->n_steps; ++s) {
+		kernel_step_t *step = kernel->steps + s;
+		if (step->kind == LOAD)
+			continue;
+		flags |= _run_step_block(step, kernel->steps[step->a].out,
+				step->kind == SCALE ? NULL : kernel->steps[step->b].out, step->buf, n);
+		step->out = step->buf;
+	}
+	return overflowed(flags) ? ARITHMETIC_OVERFLOW : SUCCESS;
+}
+
+// Суммы (SUM, L1, DOT, L2SQ) сворачиваются поблочно: сумма блока считается SIMD-циклом без
+// проверок и прибавляется к результату в __int128. Сумма KERNEL_BLOCK_SIZE слагаемых из
+// [-2^NARROW_SUM_BITS, 2^NARROW_SUM_BITS) не переполняется, а произведение сомножителей из
+// [-2^NARROW_PRODUCT_BITS, 2^NARROW_PRODUCT_BITS) лежит в этом диапазоне. Поэтому в цикле
+// проверяется только `is_narrow` для всего блока, и только если в блоке нашлись большие
+// координаты, его сумма пересчитывается точно в __int128. Поэтому промежуточные суммы и
+// произведения могут выходить за data_t: ошибкой будет только итог, который туда не вернётся.
+#define NARROW_SUM_BITS     54  // KERNEL_BLOCK_SIZE * 2^54 ≤ 2^62
+#define NARROW_PRODUCT_BITS 27
+
+/* Состояние редукции: SIMD_WIDTH частичных минимумов или максимумов и результат для хвостов     */
+/* блоков, для сумм — сумма свёрнутых блоков.                                                    */
+typedef struct {
+	simd_t lanes;
+	__int128 tail;
+	data_t flags;
+} accumulator_t;
+
+void init_accumulator(accumulator_t *acc, operator_t reduction) {
+	assert(acc);
+	const data_t initial = reduction == MIN ? DATA_T_MAX : reduction == MAX ? DATA_T_MIN : 0;
+	for (size_t i = 0; i != SIMD_WIDTH; ++i)
+		acc->lanes[i] = initial;
+	acc->tail = initial;
+	acc->flags = 0;
+}
+
+/* Вспомогательная функция для `fold_block`. Считает сумму блока без проверок переполнения и    */
+/* объединяет в `*wide` сдвинутые слагаемые или сомножители для `is_narrow`.                     */
+data_t _sum_block(
+		operator_t reduction, const data_t *restrict a, const data_t *restrict b,
+		size_t n, uint64_t *wide) {
+	assert(a && (b || reduction != DOT) && wide);
+	const unsigned bits = reduction == DOT || reduction == L2SQ ? NARROW_PRODUCT_BITS : NARROW_SUM_BITS;
+	simd_t lanes = { 0 };
+	usimd_t lanes_wide = { 0 };
+	uint64_t sum = 0;  // без UB при переполнении, переполнение проверяется отдельно
+	size_t i = 0;
+	switch (reduction) {
+	case DOT:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t u = _simd_load(a + i), v = _simd_load(b + i);
+			if (CHECKED_ARITHMETIC)
+				lanes_wide |= _simd_narrow_shift(u, bits) | _simd_narrow_shift(v, bits);
+			lanes = (simd_t) ((usimd_t) lanes + (usimd_t) _simd_multiply(u, v));
+		}
+		for (; i != n; ++i) {
+			if (CHECKED_ARITHMETIC)
+				*wide |= narrow_shift(a[i], bits) | narrow_shift(b[i], bits);
+			sum += multiplyd(a[i], b[i]);
+		}
+		break;
+	case L2SQ:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t v = _simd_load(a + i);
+			if (CHECKED_ARITHMETIC)
+				lanes_wide |= _simd_narrow_shift(v, bits);
+			lanes = (simd_t) ((usimd_t) lanes + (usimd_t) _simd_multiply(v, v));
+		}
+		for (; i != n; ++i) {
+			if (CHECKED_ARITHMETIC)
+				*wide |= narrow_shift(a[i], bits);
+			sum += multiplyd(a[i], a[i]);
+		}
+		break;
+	case SUM:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t v = _simd_load(a + i);
+			if (CHECKED_ARITHMETIC)
+				lanes_wide |= _simd_narrow_shift(v, bits);
+			lanes = (simd_t) ((usimd_t) lanes + (usimd_t) v);
+		}
+		for (; i != n; ++i) {
+			if (CHECKED_ARITHMETIC)
+				*wide |= narrow_shift(a[i], bits);
+			sum += a[i];
+		}
+		break;
+	case L1:
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t v = _simd_load(a + i);
+			if (CHECKED_ARITHMETIC)
+				lanes_wide |= _simd_narrow_shift(v, bits);
+			lanes = (simd_t) ((usimd_t) lanes + (usimd_t) _simd_abs(v));
+		}
+		for (; i != n; ++i) {
+			if (CHECKED_ARITHMETIC)
+				*wide |= narrow_shift(a[i], bits);
+			sum += absd(a[i]);
+		}
+		break;
+	default:
+		assert(0);
+	}
+	for (size_t j = 0; j != SIMD_WIDTH; ++j) {
+		*wide |= lanes_wide[j];
+		sum += lanes[j];
+	}
+	return (data_t) sum;
+}
+
+/* Вспомогательная функция для `fold_block`. Считает сумму блока точно в __int128: произведения */
+/* data_t в нём не переполняются, а переполнение суммы проверяется.                              */
+__int128 _sum_block_exact(
+		operator_t reduction, const data_t *a, const data_t *b,
+		size_t n, data_t *flags) {
+	assert(a && (b || reduction != DOT) && flags);
+	__int128 sum = 0, d;
+	for (size_t i = 0; i != n; ++i) {
+		if (reduction == DOT || reduction == L2SQ)
+			d = (__int128) a[i] * (reduction == DOT ? b[i] : a[i]);
+		else if (reduction == L1)
+			d = a[i] < 0 ? -(__int128) a[i] : a[i];
+		else
+			d = a[i];
+		*flags |= -(data_t) __builtin_add_overflow(sum, d, &sum);
+	}
+	return sum;
+}
+
+/* Сворачивает блок из `n` координат `a` (и `b` для скалярного произведения) */
+void fold_block(
+		accumulator_t *acc, operator_t reduction,
+		const data_t *restrict a, const data_t *restrict b, size_t n) {
+	assert(acc && a && (b || reduction != DOT));
+	size_t i = 0;
+	simd_t lanes = acc->lanes;
+	if (reduction == MIN) {
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t v = _simd_load(a + i);
+			lanes = _simd_select(v < lanes, v, lanes);
+		}
+		for (; i != n; ++i)
+			acc->tail = a[i] < acc->tail ? a[i] : acc->tail;
+		acc->lanes = lanes;
+		return;
+	}
+	if (reduction == MAX) {
+		for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+			const simd_t v = _simd_load(a + i);
+			lanes = _simd_select(v > lanes, v, lanes);
+		}
+		for (; i != n; ++i)
+			acc->tail = a[i] > acc->tail ? a[i] : acc->tail;
+		acc->lanes = lanes;
+		return;
+	}
+	uint64_t wide = 0;
+	__int128 sum = _sum_block(reduction, a, b, n, &wide);
+	if (CHECKED_ARITHMETIC && !is_narrow(wide, reduction == DOT || reduction == L2SQ
+			? NARROW_PRODUCT_BITS : NARROW_SUM_BITS))
+		sum = _sum_block_exact(reduction, a, b, n, &acc->flags);
+	acc->flags |= -(data_t) __builtin_add_overflow(acc->tail, sum, &acc->tail);
+}
+
+__int128 finish_accumulator(const accumulator_t *acc, operator_t reduction) {
+	assert(acc);
+	__int128 result = acc->tail;
+	for (size_t i = 0; (reduction == MIN || reduction == MAX) && i != SIMD_WIDTH; ++i)
+		if (reduction == MIN ? acc->lanes[i] < result : acc->lanes[i] > result)
+			result = acc->lanes[i];
+	return result;
+}
+
+/* Сворачивает блок из `n` координат, загруженный `load_kernel_block`, с проверками переполнения */
+error_t fold_checked_block(kernel_t *kernel, operator_t reduction, size_t a, size_t b, size_t n, __int128 *result) {
+	assert(kernel && a < kernel->n_steps && result);
+	if (run_kernel_block(kernel, n) != SUCCESS)
+		return ARITHMETIC_OVERFLOW;
+	accumulator_t acc;
+	init_accumulator(&acc, reduction);
+	fold_block(&acc, reduction, kernel->steps[a].out, reduction == DOT ? kernel->steps[b].out : NULL, n);
+	if (overflowed(acc.flags))
+		return ARITHMETIC_OVERFLOW;
+	*result = finish_accumulator(&acc, reduction);
+	return SUCCESS;
+}
+
+// Непроверяемые ядра. Координаты всегда хранятся в data_t; если границы координат векторов
+// известны после разбора (`range_bits`), из них следуют границы шагов и редукции, и тогда ядро
+// вычисляется без проверок переполнения: в data_t, если туда заведомо помещается всё, иначе в
+// __int128, что позволяет редукции выйти за data_t, если её итог туда вернётся. Если всё
+// помещается в int32_t и у ядра есть поэлементные шаги, блок вычисляется в int32_t: в регистре
+// вдвое больше координат. Хранятся векторы всё равно в data_t. Поэлементные шаги, как и без ядра,
+// обязаны помещаться в data_t. Для векторов с неизвестными границами работает `fold_checked_block`.
+
+#define SIMD_BYTES  (SIMD_WIDTH * sizeof (data_t))
+#define INT128_MAX  ((__int128) (((unsigned __int128) 1 << 127) - 1))
+#define INT128_MIN  (-INT128_MAX - 1)
+
+#define DEFINE_TYPED_KERNEL(T, NAME, T_MIN, T_MAX)                                                                          \
+typedef T NAME##_simd_t __attribute__((vector_size(SIMD_BYTES)));                                                           \
+typedef data_t NAME##_source_t __attribute__((vector_size(SIMD_BYTES / sizeof (T) * sizeof (data_t))));                     \
+enum { NAME##_WIDTH = SIMD_BYTES / sizeof (T) };                                                                            \
+                                                                                                                            \
+/* Переводит `n` координат в тип специализации */                                                                           \
+void _convert_##NAME(const data_t *restrict src, T *restrict dst, size_t n) {                                               \
+	size_t i = 0;                                                                                                           \
+	for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                      \
+		NAME##_source_t s;                                                                                                  \
+		memcpy(&s, src + i, sizeof s);                                                                                      \
+		const NAME##_simd_t v = __builtin_convertvector(s, NAME##_simd_t);                                                  \
+		memcpy(dst + i, &v, sizeof v);                                                                                      \
+	}                                                                                                                       \
+	for (; i != n; ++i)                                                                                                     \
+		dst[i] = (T) src[i];                                                                                                \
+}                                                                                                                           \
+                                                                                                                            \
+/* Вычисляет шаг ядра для блока без проверок переполнения */                                                                \
+void _run_step_block_##NAME(const kernel_step_t *step, const T *restrict a, const T *restrict b, T *restrict c, size_t n) { \
+	assert(step && a && c && (b || step->kind == SCALE));                                                                   \
+	const T number = (T) step->number;                                                                                      \
+	NAME##_simd_t u, v;                                                                                                     \
+	size_t i = 0;                                                                                                           \
+	switch (step->kind) {                                                                                                   \
+	case ADD:                                                                                                               \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			memcpy(&v, b + i, sizeof v);                                                                                    \
+			u += v;                                                                                                         \
+			memcpy(c + i, &u, sizeof u);                                                                                    \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			c[i] = a[i] + b[i];                                                                                             \
+		break;                                                                                                              \
+	case SUBTRACT:                                                                                                          \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			memcpy(&v, b + i, sizeof v);                                                                                    \
+			u -= v;                                                                                                         \
+			memcpy(c + i, &u, sizeof u);                                                                                    \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			c[i] = a[i] - b[i];                                                                                             \
+		break;                                                                                                              \
+	case SCALE:                                                                                                             \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			u *= number;                                                                                                    \
+			memcpy(c + i, &u, sizeof u);                                                                                    \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			c[i] = a[i] * number;                                                                                           \
+		break;                                                                                                              \
+	default:                                                                                                                \
+		assert(0);                                                                                                          \
+	}                                                                                                                       \
+}                                                                                                                           \
+                                                                                                                            \
+/* Сворачивает блок без проверок переполнения */                                                                            \
+T _fold_block_##NAME(operator_t reduction, const T *restrict a, const T *restrict b, size_t n) {                            \
+	assert(a && (b || reduction != DOT));                                                                                   \
+	T acc = reduction == MIN ? T_MAX : reduction == MAX ? T_MIN : 0;                                                        \
+	NAME##_simd_t lanes = { 0 }, u, v, mask;                                                                                \
+	size_t i = 0;                                                                                                           \
+	switch (reduction) {                                                                                                    \
+	case DOT:                                                                                                               \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			memcpy(&v, b + i, sizeof v);                                                                                    \
+			lanes += u * v;                                                                                                 \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc += a[i] * b[i];                                                                                             \
+		break;                                                                                                              \
+	case L2SQ:                                                                                                              \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			lanes += u * u;                                                                                                 \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc += a[i] * a[i];                                                                                             \
+		break;                                                                                                              \
+	case SUM:                                                                                                               \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			lanes += u;                                                                                                     \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc += a[i];                                                                                                    \
+		break;                                                                                                              \
+	case L1:                                                                                                                \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			mask = u >> (sizeof (T) * 8 - 1);                                                                               \
+			lanes += (u ^ mask) - mask;                                                                                     \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc += a[i] < 0 ? -a[i] : a[i];                                                                                 \
+		break;                                                                                                              \
+	case MIN:                                                                                                               \
+		lanes += acc;                                                                                                       \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			mask = u < lanes;                                                                                               \
+			lanes = (u & mask) | (lanes & ~mask);                                                                           \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc = a[i] < acc ? a[i] : acc;                                                                                  \
+		for (size_t j = 0; j != NAME##_WIDTH; ++j)                                                                          \
+			acc = lanes[j] < acc ? lanes[j] : acc;                                                                          \
+		return acc;                                                                                                         \
+	case MAX:                                                                                                               \
+		lanes += acc;                                                                                                       \
+		for (; i + NAME##_WIDTH <= n; i += NAME##_WIDTH) {                                                                  \
+			memcpy(&u, a + i, sizeof u);                                                                                    \
+			mask = u > lanes;                                                                                               \
+			lanes = (u & mask) | (lanes & ~mask);                                                                           \
+		}                                                                                                                   \
+		for (; i != n; ++i)                                                                                                 \
+			acc = a[i] > acc ? a[i] : acc;                                                                                  \
+		for (size_t j = 0; j != NAME##_WIDTH; ++j)                                                                          \
+			acc = lanes[j] > acc ? lanes[j] : acc;                                                                          \
+		return acc;                                                                                                         \
+	default:                                                                                                                \
+		assert(0);                                                                                                          \
+	}                                                                                                                       \
+	for (size_t j = 0; j != NAME##_WIDTH; ++j)                                                                              \
+		acc += lanes[j];                                                                                                    \
+	return acc;                                                                                                             \
+}                                                                                                                           \
+                                                                                                                            \
+/* То же, что `fold_checked_block`, но в типе T и без проверок переполнения */                                              \
+__int128 fold_kernel_block_##NAME(kernel_t *kernel, operator_t reduction, size_t a, size_t b, size_t n) {                   \
+	assert(kernel && a < kernel->n_steps);                                                                                  \
+	for (size_t s = 0; s != kernel->n_steps; ++s) {                                                                         \
+		kernel_step_t *step = kernel->steps + s;                                                                            \
+		if (step->kind == LOAD) {                                                                                           \
+			if (sizeof (T) != sizeof (data_t)) {                                                                            \
+				_convert_##NAME(step->out, step->typed_buf, n);                                                             \
+				step->out = step->typed_buf;                                                                                \
+			}                                                                                                               \
+			continue;                                                                                                       \
+		}                                                                                                                   \
+		_run_step_block_##NAME(step, kernel->steps[step->a].out,                                                            \
+				step->kind == SCALE ? NULL : kernel->steps[step->b].out, step->typed_buf, n);                               \
+		step->out = step->typed_buf;                                                                                        \
+	}                                                                                                                       \
+	return _fold_block_##NAME(reduction, kernel->steps[a].out, reduction == DOT ? kernel->steps[b].out : NULL, n);          \
+}
+
+#define KERNEL_TYPES(X)                        \
+	X(int32_t,  int32,  INT32_MIN,  INT32_MAX)  \
+	X(int64_t,  int64,  INT64_MIN,  INT64_MAX)  \
+	X(__int128, int128, INT128_MIN, INT128_MAX)
+
+KERNEL_TYPES(DEFINE_TYPED_KERNEL)
+
+/* Загружает координаты [begin, begin + n) векторов ядра */
+void load_kernel_block(kernel_t *kernel, size_t begin, size_t n) {
+	assert(kernel);
+	for (size_t s = 0; s != kernel->n_steps; ++s)
+		if (kernel->steps[s].kind == LOAD)
+			_load_block(kernel->steps + s, begin, n);
+}
+
+/* Возвращает, сколько бит нужно ядру вместе с редукцией `length` координат, или SIZE_MAX, если  */
+/* шаг может не поместиться в data_t.                                                           */
+size_t kernel_bits(const kernel_t *kernel, operator_t reduction, size_t a, size_t b, size_t length) {
+	assert(kernel && a < kernel->n_steps);
+	size_t bits = 0;
+	for (size_t s = 0; s != kernel->n_steps; ++s)
+		bits = maxlu(bits, kernel->steps[s].bits);
+	if (bits >= 64)
+		return SIZE_MAX;
+	const size_t bits_a = kernel->steps[a].bits, count = bit_length(length);
+	switch (reduction) {
+	case SUM:
+		return maxlu(bits, bits_a + count);
+	case L1:
+		return maxlu(bits, bits_a + count + 1);
+	case DOT:
+		return maxlu(bits, bits_a + kernel->steps[b].bits + count + 1);
+	case L2SQ:
+		return maxlu(bits, 2 * bits_a + count + 1);
+	default:
+		return bits;
+	}
+}
+
+/* Есть ли в ядре поэлементные шаги. Без них int32_t не быстрее data_t: загрузка блока в int32_t */
+/* стоит дороже, чем выигрыш от вдвое большего числа координат в регистре.                      */
+bool _has_elementwise_steps(const kernel_t *kernel) {
+	assert(kernel);
+	for (size_t s = 0; s != kernel->n_steps; ++s)
+		if (kernel->steps[s].kind != LOAD)
+			return true;
+	return false;
+}
+
+/* Вычисляет ядро и сворачивает результат шага `a` (и `b` для скалярного произведения): без  */
+/* проверок, если границы это позволяют, иначе с проверками. Суммы блоков в любом случае      */
+/* копятся в __int128, поэтому тип выбирается по границам одного блока, и ошибкой становится  */
+/* только итог, не помещающийся в data_t.                                                     */
+error_t run_kernel(kernel_t *kernel, operator_t reduction, size_t a, size_t b, data_t *result) {
+	assert(kernel && a < kernel->n_steps && result);
+	size_t length = kernel->steps[a].dimension;
+	if (reduction == DOT)
+		length = minlu(length, kernel->steps[b].dimension);
+	const size_t bits = kernel_bits(kernel, reduction, a, b, minlu(length, KERNEL_BLOCK_SIZE));
+	const bool narrow = bits < 32 && _has_elementwise_steps(kernel);
+	__int128 total = reduction == MIN ? INT128_MAX : reduction == MAX ? INT128_MIN : 0, block;
+	for (size_t begin = 0; begin < length; begin += KERNEL_BLOCK_SIZE) {
+		const size_t n = minlu(length - begin, KERNEL_BLOCK_SIZE);
+		load_kernel_block(kernel, begin, n);
+		if (narrow)
+			block = fold_kernel_block_int32(kernel, reduction, a, b, n);
+		else if (bits < 64)
+			block = fold_kernel_block_int64(kernel, reduction, a, b, n);
+		else if (bits < 128)
+			block = fold_kernel_block_int128(kernel, reduction, a, b, n);
+		else if (fold_checked_block(kernel, reduction, a, b, n, &block) != SUCCESS)
+			return ARITHMETIC_OVERFLOW;
+		if (reduction == MIN)
+			total = block < total ? block : total;
+		else if (reduction == MAX)
+			total = block > total ? block : total;
+		else if (__builtin_add_overflow(total, block, &total))
+			return ARITHMETIC_OVERFLOW;
+	}
+	*result = (data_t) total;
+	if (CHECKED_ARITHMETIC && *result != total)
+		return ARITHMETIC_OVERFLOW;
+	return SUCCESS;
+}
+
+// ──── algorithm ─────────────────────────────────────────────────────────────────────────────────
+
+/* Вынимает из стека не указатель на значение, а само значение */
+operator_t pop_operator(stack_node_t **operators) {
+	assert(operators && *operators);
+	operator_t *p_operator = pop(operators);
+	operator_t operator = *p_operator;
+	free(p_operator);
+	return operator;
+}
+
+// Алгоритм сортировочной станции выводит операторы функцией `emit` в её `target` — в
+// `compile_stream` это граф выражения, который определён ниже.
+typedef error_t (*emit_operator_ft)(void *target, operator_t operator);
+
+/* Кладёт, в соответствии с алгоритмом сортировочной станции, оператор в стэк, выводя          */
+/* вытесненные операторы через `emit`. В случае ошибки удаляет стэк.                             */
+error_t handle_push_operator_error(stack_node_t **operators, operator_t operator, emit_operator_ft emit, void *target) {
+	assert(operators && emit);
+	error_t error;
+	if (operator == OPEN_BRACKET)
+		return handle_push_error(operators, &operator, sizeof operator);
+	if (is_reduction(operator)) {
+		operator_t bracket = OPEN_BRACKET;
+		if ((error = handle_push_error(operators, &operator, sizeof operator)) != SUCCESS)
+			return error;
+		return handle_push_error(operators, &bracket, sizeof bracket);
+	}
+	if (operator == CLOSE_BRACKET || operator == ARGUMENT_SEPARATOR) {
+		operator_t bracket;
+		while (true) {
+			if (!*operators)
+				return INVALID_FORMAT;
+			bracket = pop_operator(operators);
+			if (is_bracket(bracket))
+				break;
+			if ((error = emit(target, bracket)) != SUCCESS)
+				return _shutdown_with_delete_stack(error, operators);
+		}
+		// скобка сразу над функцией — это скобка её вызова
+		const bool is_call = *operators && is_reduction(*(operator_t *) top(*operators));
+		if (operator == ARGUMENT_SEPARATOR) {
+			if (bracket != OPEN_BRACKET || !is_call || arity(*(operator_t *) top(*operators)) != 2)
+				return _shutdown_with_delete_stack(INVALID_FORMAT, operators);
+			bracket = SECOND_ARGUMENT_BRACKET;
+			return handle_push_error(operators, &bracket, sizeof bracket);
+		}
+		if (!is_call)
+			return SUCCESS;
+		const operator_t function = pop_operator(operators);
+		if ((arity(function) == 2) != (bracket == SECOND_ARGUMENT_BRACKET))
+			return _shutdown_with_delete_stack(INVALID_FORMAT, operators);
+		if ((error = emit(target, function)) != SUCCESS)
+			return _shutdown_with_delete_stack(error, operators);
+		return SUCCESS;
+	}
+	// все поэлементные операции левоассоциативны
+	while (*operators && precedence(*(operator_t *) top(*operators)) >= precedence(operator))
+		if ((error = emit(target, pop_operator(operators))) != SUCCESS)
+			return _shutdown_with_delete_stack(error, operators);
+	return handle_push_error(operators, &operator, sizeof operator);
+}
+
+/* Выводит через `emit` оставшиеся в стэке операторы, в случае ошибки удаляет стэк */
+error_t handle_flush_operators_error(stack_node_t **operators, emit_operator_ft emit, void *target) {
+	assert(operators && emit);
+	while (*operators) {
+		const operator_t operator = pop_operator(operators);
+		const error_t error = is_bracket(operator) ? INVALID_FORMAT : emit(target, operator);
+		if (error != SUCCESS)
+			return _shutdown_with_delete_stack(error, operators);
+	}
+	return SUCCESS;
+}
+
+/* `_add_operands`, по аналогии с `_add_vectors`, складывает или вычитает операнды               */
+typedef error_t (*add_vectors_ft)(const vector_t *, const vector_t *, vector_t *);
+error_t _add_operands(const operand_t *a, const operand_t *b, operand_t *c, add_vectors_ft _add) {
+	assert(a && b && c && _add);
+	if (a->type == VECTOR && b->type == VECTOR)
+		return _add(&a->vector, &b->vector, &c->vector);
+	return INVALID_FORMAT;
+}
+
+static inline error_t add_operands(const operand_t *a, const operand_t *b, operand_t *c) {
+	assert(a && b && c);
+	return _add_operands(a, b, c, &add_vectors);
+}
+
+static inline error_t subtract_operands(const operand_t *a, const operand_t *b, operand_t *c) {
+	assert(a && b && c);
 	return _add_operands(a, b, c, &subtract_vectors);
 }
 
@@ -568,8 +1826,33 @@ error_t multiply_operands(const operand_t *a, const operand_t *b, operand_t *c)
 	return INVALID_FORMAT;
 }
 
+/* Вычисляет редукцию материализованных операндов, `b` равен NULL для редукций от одного        */
+/* аргумента.                                                                                    */
+error_t reduce_operands(const operand_t *a, const operand_t *b, operand_t *c, operator_t reduction) {
+	assert(a && c && is_reduction(reduction) && !b == (arity(reduction) == 1));
+	if (a->type != VECTOR || (b && b->type != VECTOR))
+		return INVALID_FORMAT;
+	kernel_t kernel;
+	if (create_kernel(&kernel, 2) != SUCCESS)
+		return ALLOC_FAILURE;
+	kernel_step_t load = { .kind = LOAD, .vector = &a->vector };
+	const size_t step_a = add_kernel_step(&kernel, &load);
+	size_t step_b = 0;
+	if (b) {
+		load.vector = &b->vector;
+		step_b = add_kernel_step(&kernel, &load);
+	}
+	c->type = NUMBER;
+	const error_t error = run_kernel(&kernel, reduction, step_a, step_b, &c->number);
+	delete_kernel(&kernel);
+	return error;
+}
+
 error_t execute(const operand_t *a, const operand_t *b, operand_t *c, operator_t operator) {
-	assert(a && b && c);
+	assert(a && c);
+	if (is_reduction(operator))
+		return reduce_operands(a, b, c, operator);
+	assert(b);
 	switch (operator) {
 	case PLUS:
 		return add_operands(a, b, c);
@@ -582,159 +1865,1609 @@ error_t execute(const operand_t *a, const operand_t *b, operand_t *c, operator_t
 	}
 }
 
-/* Вспомогательная функция для `calculate`. Освобождает выделенную внутри функции память. По     */
-/* сути это _shutdown_with_delete_stack_and_operand.                                             */
-error_t _shutdown_calculate(error_t error, stack_node_t **stack, operand_t *operand) {
-	assert(stack && operand);
-	delete_stack(stack);
-	delete_operand(operand);
-	return error;
+// ──── expression ────────────────────────────────────────────────────────────────────────────────
+
+// Выражение разбирается в ориентированный ациклический граф. Одинаковые подвыражения
+// (заполнители с одинаковым именем и одинаковые операции над одними и теми же узлами)
+// представлены одним узлом, поэтому вычисляются один раз. Узлы хранятся в порядке создания,
+// который является топологическим, так что вычисление графа — это один проход по списку узлов.
+// Операнды разбираются сразу в листья-значения. Одинаковые литералы тоже объединяются: хэш
+// значения считается при разборе, а сравниваются значения только при совпадении хэшей.
+// Отображённые векторы не объединяются.
+// Значение узла освобождается, как только вычислены все использующие его узлы. Граф можно
+// вычислять повторно: значения заполнителей берутся из аргументов вычисления, а постоянные
+// листья (`persistent`) хранят значения до удаления графа, и те и другие не освобождаются.
+//
+// Поэлементные операции, результат которых используется только редукцией (напрямую или через
+// другие такие же операции), сливаются с ней: редукция вычисляет их поблочно одним ядром, а
+// слитые узлы не вычисляются сами по себе.
+//
+// Выражение без связываний может вычисляться по мере разбора (`eager`): операция вне аргументов
+// редукций, все аргументы которой уже вычислены, вычисляется сразу, как только выведена, и её
+// аргументы освобождаются. У таких узлов `pending` — это количество ссылок на них со стэка
+// разбора и из невычисленных узлов, а `evaluate_dag` их пропускает.
+
+#define MAX_FUSED_NODES 64
+
+typedef struct expr_node_t {
+	enum {
+		VALUE = 0,  // лист с уже разобранным значением
+		PLACEHOLDER,
+		OPERATION
+	} kind;
+	operator_t operator;
+	const char *text;  // имя заполнителя
+	size_t length;
+	struct expr_node_t *a, *b;  // `b` равен NULL для операций от одного аргумента
+	unsigned long long hash;
+	size_t uses;     // количество использующих узлов
+	size_t pending;  // количество ещё не вычисленных использующих узлов
+	bool evaluated;
+	bool persistent;  // значение листа не освобождается при вычислении
+	bool eager;       // вычисляется при разборе, см. `compile_stream`
+	operand_t value;
+	struct expr_node_t *fused_into;  // редукция, с которой слит узел, или NULL
+	struct expr_node_t **fused;      // слитые с редукцией узлы в топологическом порядке
+	size_t n_fused;
+	size_t step;                     // номер шага ядра, вычисляющего слитый узел
+	struct expr_node_t *next_in_bucket;
+	struct expr_node_t *next;
+} expr_node_t;
+
+typedef struct {
+	expr_node_t **buckets;
+	size_t n_buckets;
+	size_t n_nodes;
+	size_t n_placeholders;
+	expr_node_t *first;
+	expr_node_t *last;
+} expr_dag_t;
+
+error_t create_dag(expr_dag_t *dag) {
+	assert(dag);
+	dag->n_buckets = STD_BUF_SIZE;
+	dag->n_nodes = dag->n_placeholders = 0;
+	dag->first = dag->last = NULL;
+	if (!(dag->buckets = calloc(dag->n_buckets, sizeof *dag->buckets)))
+		return ALLOC_FAILURE;
+	return SUCCESS;
 }
 
-/* Вспомогательная функция для `calculate`. Кладёт результат операции в стэк, в случае ошибки    */
-/* удаляет его (стэк).                                                                           */
-error_t handle_push_operand_error(stack_node_t **operands, operand_t *result, operator_t operator) {
-	if (!*operands)
-		return INVALID_FORMAT;
-	operand_t b = pop_operand(operands);
-	if (!*operands) {
-		delete_operand(&b);
+void delete_dag(expr_dag_t *dag) {
+	assert(dag);
+	while (dag->first) {
+		expr_node_t *node = dag->first;
+		dag->first = node->next;
+		if (node->evaluated && node->kind != PLACEHOLDER)
+			delete_operand(&node->value);
+		free(node->fused);
+		free(node);
+	}
+	free(dag->buckets);
+	dag->buckets = NULL;
+	dag->last = NULL;
+	dag->n_buckets = dag->n_nodes = dag->n_placeholders = 0;
+}
+
+/* Значение узла принадлежит вычислению: оно создаётся и освобождается при каждом вычислении */
+static inline bool _owns_value(const expr_node_t *node) {
+	assert(node);
+	return node->kind != PLACEHOLDER && !node->persistent;
+}
+
+/* Освобождает значения, оставшиеся после вычисления графа */
+void reset_dag(expr_dag_t *dag) {
+	assert(dag);
+	for (expr_node_t *node = dag->first; node; node = node->next) {
+		if (node->persistent)
+			continue;
+		if (node->evaluated && _owns_value(node))
+			delete_operand(&node->value);
+		node->evaluated = false;
+	}
+}
+
+/* Уменьшает число невычисленных использующих узлов и, если их не осталось, освобождает        */
+/* значение узла.                                                                                */
+void release_node(expr_node_t *node) {
+	assert(node && node->pending);
+	if (!--node->pending && node->evaluated && _owns_value(node)) {
+		delete_operand(&node->value);
+		node->evaluated = false;
+	}
+}
+
+unsigned long long hash_text(const char *text, size_t length) {
+	assert(text);
+	unsigned long long hash = EXPR_HASH_BASIS;
+	for (size_t i = 0; i != length; ++i)
+		hash = _hash_step(hash, (unsigned char) text[i]);
+	return hash;
+}
+
+unsigned long long hash_operation(operator_t operator, const expr_node_t *a, const expr_node_t *b) {
+	assert(a);
+	unsigned long long hash = _hash_step(EXPR_HASH_BASIS, operator);
+	hash = _hash_step(hash, (unsigned long long) (uintptr_t) a);
+	return _hash_step(hash, (unsigned long long) (uintptr_t) b);
+}
+
+/* Равны ли значения листов. Отображённые векторы не сравниваются */
+bool _same_value(const operand_t *a, const operand_t *b) {
+	assert(a && b);
+	if (a->type != b->type)
+		return false;
+	if (a->type == NUMBER)
+		return a->number == b->number;
+	const vector_t *u = &a->vector, *v = &b->vector;
+	if (u->mapped || v->mapped || u->dimension != v->dimension || u->representation != v->representation)
+		return false;
+	if (u->representation == DENSE)
+		return !memcmp(u->components, v->components, u->dimension * sizeof (data_t));
+	return u->n_nonzero == v->n_nonzero && (!u->n_nonzero
+		|| (!memcmp(u->components, v->components, u->n_nonzero * sizeof (data_t))
+			&& !memcmp(u->indices, v->indices, u->n_nonzero * sizeof (size_t))));
+}
+
+static inline bool _same_node(const expr_node_t *node, const expr_node_t *pattern) {
+	assert(node && pattern);
+	if (node->hash != pattern->hash || node->kind != pattern->kind)
+		return false;
+	if (node->kind == VALUE)
+		return node->evaluated && _same_value(&node->value, &pattern->value);
+	if (node->kind != OPERATION)
+		return node->length == pattern->length && !memcmp(node->text, pattern->text, node->length);
+	return node->operator == pattern->operator && node->a == pattern->a && node->b == pattern->b;
+}
+
+error_t _rehash_dag(expr_dag_t *dag) {
+	assert(dag);
+	const size_t n_buckets = dag->n_buckets * STD_BUF_SIZE_MULT;
+	expr_node_t **buckets = calloc(n_buckets, sizeof *buckets);
+	if (!buckets)
+		return ALLOC_FAILURE;
+	for (expr_node_t *node = dag->first; node; node = node->next) {
+		if (node->eager && !node->evaluated)  // см. `_release_eager_node`
+			continue;
+		expr_node_t **bucket = buckets + node->hash % n_buckets;
+		node->next_in_bucket = *bucket;
+		*bucket = node;
+	}
+	free(dag->buckets);
+	dag->buckets = buckets;
+	dag->n_buckets = n_buckets;
+	return SUCCESS;
+}
+
+/* Записывает в `*pnode` узел графа, равный `pattern`. Если такого узла ещё нет, создаёт его     */
+/* и добавляет в конец списка узлов.                                                             */
+error_t intern_node(expr_dag_t *dag, const expr_node_t *pattern, expr_node_t **pnode) {
+	assert(dag && pattern && pnode);
+	expr_node_t **bucket = dag->buckets + pattern->hash % dag->n_buckets;
+	for (expr_node_t *node = *bucket; node; node = node->next_in_bucket)
+		if (_same_node(node, pattern)) {
+			*pnode = node;
+			return SUCCESS;
+		}
+	// таблица расширяется до добавления узла, так как новый узел ещё не вычислен
+	if (dag->n_nodes == dag->n_buckets) {
+		if (_rehash_dag(dag) != SUCCESS)
+			return ALLOC_FAILURE;
+		bucket = dag->buckets + pattern->hash % dag->n_buckets;
+	}
+
+	expr_node_t *node = malloc(sizeof *node);
+	if (!node)
+		return ALLOC_FAILURE;
+	*node = *pattern;
+	node->uses = node->pending = 0;
+	node->evaluated = false;
+	node->fused_into = NULL;
+	node->fused = NULL;
+	node->n_fused = 0;
+	node->next = NULL;
+	node->next_in_bucket = *bucket;
+	*bucket = node;
+	if (node->kind == OPERATION) {
+		++node->a->uses;
+		if (node->b)
+			++node->b->uses;
+	}
+	else if (node->kind == PLACEHOLDER)
+		++dag->n_placeholders;
+	if (dag->last)
+		dag->last->next = node;
+	else
+		dag->first = node;
+	dag->last = node;
+	*pnode = node;
+	++dag->n_nodes;
+	return SUCCESS;
+}
+
+/* Связывание имени с узлом графа */
+typedef struct {
+	name_t name;
+	expr_node_t *node;
+} binding_t;
+
+/* Значение заполнителя */
+typedef struct {
+	name_t name;
+	operand_t value;
+} argument_t;
+
+/* Возвращает значение заполнителя `name` или NULL */
+const operand_t *find_argument(const stack_node_t *arguments, const name_t *name) {
+	assert(name);
+	for (; arguments; arguments = arguments->next) {
+		const argument_t *argument = arguments->data;
+		if (equal_names(&argument->name, name))
+			return &argument->value;
+	}
+	return NULL;
+}
+
+/* Возвращает узел, связанный с именем `name` последним, или NULL */
+expr_node_t *find_binding(const stack_node_t *bindings, const name_t *name) {
+	assert(name);
+	for (; bindings; bindings = bindings->next) {
+		const binding_t *binding = bindings->data;
+		if (equal_names(&binding->name, name))
+			return binding->node;
+	}
+	return NULL;
+}
+
+expr_node_t *pop_node(stack_node_t **nodes) {
+	assert(nodes && *nodes);
+	expr_node_t **p_node = pop(nodes);
+	expr_node_t *node = *p_node;
+	free(p_node);
+	return node;
+}
+
+/* Снимает ссылку на вычисленный при разборе узел. Освобождённый узел убирается из хэш-таблицы: */
+/* вычислить его заново всё равно не из чего, а одинаковые литералы иначе копились бы в одной    */
+/* корзине.                                                                                      */
+void _release_eager_node(expr_dag_t *dag, expr_node_t *node) {
+	assert(dag && node && node->eager);
+	release_node(node);
+	if (node->evaluated)
+		return;
+	expr_node_t **link = dag->buckets + node->hash % dag->n_buckets;
+	while (*link != node)
+		link = &(*link)->next_in_bucket;
+	*link = node->next_in_bucket;
+}
+
+/* Кладёт узел на стэк разбора. Вычисленный при разборе узел учитывает ссылку со стэка */
+error_t _push_node(stack_node_t **nodes, expr_node_t *node) {
+	assert(nodes && node);
+	if (node->eager)
+		++node->pending;
+	return handle_push_error(nodes, &node, sizeof node);
+}
+
+/* Вспомогательная функция для `handle_push_operation_error`. Вычисляет новый узел `node` и      */
+/* снимает ссылки со стэка на его аргументы.                                                     */
+error_t _evaluate_eager_node(expr_dag_t *dag, expr_node_t *node) {
+	assert(dag && node && node->eager);
+	if (!node->evaluated) {
+		init_operand(&node->value);
+		const error_t error = execute(&node->a->value, node->b ? &node->b->value : NULL, &node->value, node->operator);
+		if (error != SUCCESS) {
+			node->value.type = NUMBER;
+			return error;
+		}
+		node->evaluated = true;
+	}
+	_release_eager_node(dag, node->a);
+	if (node->b)
+		_release_eager_node(dag, node->b);
+	return SUCCESS;
+}
+
+/* Вспомогательная функция для `compile_stream`. Снимает со стэка аргументы операции и кладёт   */
+/* на него узел операции, в случае ошибки удаляет стэк. Если `eager`, операция над вычисленными */
+/* аргументами вычисляется сразу.                                                                */
+error_t handle_push_operation_error(expr_dag_t *dag, stack_node_t **nodes, operator_t operator, bool eager) {
+	assert(dag && nodes);
+	expr_node_t pattern = { .kind = OPERATION, .operator = operator };
+	if (arity(operator) == 2) {
+		if (!*nodes)
+			return INVALID_FORMAT;
+		pattern.b = pop_node(nodes);
+	}
+	if (!*nodes)
 		return INVALID_FORMAT;
+	pattern.a = pop_node(nodes);
+	pattern.hash = hash_operation(operator, pattern.a, pattern.b);
+	pattern.eager = eager && !is_reduction(operator) && pattern.a->eager && (!pattern.b || pattern.b->eager);
+	const size_t n_nodes = dag->n_nodes;
+	expr_node_t *node;
+	error_t error = intern_node(dag, &pattern, &node);
+	if (error != SUCCESS)
+		return _shutdown_with_delete_stack(error, nodes);
+	if (node->eager)
+		error = _evaluate_eager_node(dag, node);
+	else if (dag->n_nodes == n_nodes) {
+		// ссылки со стэка на вычисленные аргументы уже учтены в существующем узле
+		if (pattern.a->eager)
+			_release_eager_node(dag, pattern.a);
+		if (pattern.b && pattern.b->eager)
+			_release_eager_node(dag, pattern.b);
 	}
-	operand_t a = pop_operand(operands);
-	const error_t error = execute(&a, &b, result, operator);
-	delete_operand(&a);
-	delete_operand(&b);
+	if (error != SUCCESS)
+		return _shutdown_with_delete_stack(error, nodes);
+	return _push_node(nodes, node);
+}
+
+/* Вспомогательная функция для `compile_stream`. Кладёт в стэк узел, связанный с именем, или    */
+/* заполнитель, если имя не связано. В случае ошибки удаляет стэк.                               */
+error_t handle_push_name_error(
+		expr_dag_t *dag, const stack_node_t *bindings,
+		stack_node_t **nodes, const name_t *name) {
+	assert(dag && nodes && name);
+	expr_node_t *node = find_binding(bindings, name);
+	if (!node) {
+		expr_node_t pattern = { .kind = PLACEHOLDER, .text = name->begin, .length = name->length };
+		pattern.hash = hash_text(pattern.text, pattern.length);
+		const error_t error = intern_node(dag, &pattern, &node);
+		if (error != SUCCESS)
+			return _shutdown_with_delete_stack(error, nodes);
+	}
+	return _push_node(nodes, node);
+}
+
+/* Вспомогательная функция для `compile_stream`. Кладёт в стэк лист со значением `value` и его  */
+/* хэшем `hash`. Если такой лист уже есть, `value` удаляется. Если `eager`, лист учитывает      */
+/* ссылки на него, как вычисленный при разборе узел. В случае ошибки удаляет стэк и значение.   */
+error_t handle_push_value_error(
+		expr_dag_t *dag, stack_node_t **nodes,
+		operand_t *value, unsigned long long hash, bool eager) {
+	assert(dag && nodes && value);
+	const expr_node_t pattern = { .kind = VALUE, .hash = hash, .eager = eager, .value = *value };
+	expr_node_t *node;
+	const error_t error = intern_node(dag, &pattern, &node);
 	if (error != SUCCESS) {
-		result->type = NUMBER;
-		return _shutdown_with_delete_stack(error, operands);
+		delete_operand(value);
+		return _shutdown_with_delete_stack(error, nodes);
+	}
+	if (node->evaluated)
+		delete_operand(value);
+	else {
+		node->value = *value;
+		node->evaluated = true;
 	}
-	return handle_push_error(operands, result, sizeof *result);
+	return _push_node(nodes, node);
 }
 
-error_t calculate(const char *expr, vector_t *vector) {
-	assert(expr && vector);
-	const char *run = expr;
-	stack_node_t *operands = NULL;
-	operand_t result;
-	init_operand(&result);
-	while (*run) {
-		operand_t operand;
-		error_t error = sread_operand(&run, &operand, 1);
-		if (error == SUCCESS) {
-			// safe push
-			if (handle_push_error(&operands, &operand, sizeof operand) != SUCCESS)
-				return _shutdown_with_delete_operand(ALLOC_FAILURE, &result);
+/* Вспомогательная функция для `fuse_reductions`. Сливает с редукцией `reduction` узел `node` и  */
+/* его аргументы, если они — поэлементные операции, нужные только ей.                            */
+void _try_fuse(expr_node_t *reduction, expr_node_t *node, size_t *n_fused) {
+	assert(reduction && n_fused);
+	if (!node || node->kind != OPERATION || node->eager || !is_elementwise(node->operator) || node->uses != 1
+			|| *n_fused == MAX_FUSED_NODES)
+		return;
+	node->fused_into = reduction;
+	++*n_fused;
+	_try_fuse(reduction, node->a, n_fused);
+	_try_fuse(reduction, node->b, n_fused);
+}
+
+/* Находит узлы, которые можно слить с редукциями, и заполняет списки слитых узлов */
+error_t fuse_reductions(expr_dag_t *dag) {
+	assert(dag);
+	expr_node_t **nodes = malloc(dag->n_nodes * sizeof *nodes);
+	if (!nodes)
+		return ALLOC_FAILURE;
+	size_t n_nodes = 0;
+	for (expr_node_t *node = dag->first; node; node = node->next)
+		nodes[n_nodes++] = node;
+	// обход от корня к листьям: редукция, слитая с другой, невозможна
+	for (size_t i = n_nodes; i--;) {
+		expr_node_t *node = nodes[i];
+		if (node->kind != OPERATION || !is_reduction(node->operator))
 			continue;
+		size_t n_fused = 0;
+		_try_fuse(node, node->a, &n_fused);
+		_try_fuse(node, node->b, &n_fused);
+		if (n_fused && !(node->fused = malloc(n_fused * sizeof *node->fused)))
+			return _shutdown_with_free(ALLOC_FAILURE, nodes);
+	}
+	for (size_t i = 0; i != n_nodes; ++i)
+		if (nodes[i]->fused_into) {
+			expr_node_t *reduction = nodes[i]->fused_into;
+			reduction->fused[reduction->n_fused++] = nodes[i];
 		}
-		else if (error != NOT_AN_OPERAND)  // ALLOC_FAILURE
-			return _shutdown_calculate(error, &operands, &result);
+	free(nodes);
+	return SUCCESS;
+}
 
-		// it must be an operator
-		operator_t operator;
-		sread_operator(&run, &operator, 1);
-		if ((error = handle_push_operand_error(&operands, &result, operator)) != SUCCESS)
-			return _shutdown_with_delete_operand(error, &result);
+/* Освобождает аргументы редукции и слитых с ней узлов, вычисленные отдельно */
+void _release_fused(expr_node_t *reduction) {
+	assert(reduction);
+	for (size_t i = 0; i <= reduction->n_fused; ++i) {
+		expr_node_t *node = i != reduction->n_fused ? reduction->fused[i] : reduction;
+		if (node->a->fused_into != reduction)
+			release_node(node->a);
+		if (node->b && node->b->fused_into != reduction)
+			release_node(node->b);
+	}
+}
+
+/* Вспомогательная функция для `evaluate_reduction`. Записывает в `*step` номер шага ядра,       */
+/* вычисляющего векторный аргумент `node`, при необходимости добавляя шаг загрузки.              */
+error_t _kernel_argument(kernel_t *kernel, const expr_node_t *reduction, const expr_node_t *node, size_t *step) {
+	assert(kernel && reduction && node && step);
+	if (node->fused_into == reduction) {
+		*step = node->step;
+		return SUCCESS;
 	}
-	if (!operands)
-		return _shutdown_with_delete_operand(INVALID_FORMAT, &result);
-	result = pop_operand(&operands);
-	if (operands)
-		return _shutdown_calculate(INVALID_FORMAT, &operands, &result);
-	*vector = result.vector;
+	if (node->value.type != VECTOR)
+		return INVALID_FORMAT;
+	const kernel_step_t load = { .kind = LOAD, .vector = &node->value.vector };
+	*step = add_kernel_step(kernel, &load);
 	return SUCCESS;
 }
 
-// ──── line ──────────────────────────────────────────────────────────────────────────────────────
+static inline bool _is_number_argument(const expr_node_t *reduction, const expr_node_t *node) {
+	assert(reduction && node);
+	return node->fused_into != reduction && node->value.type == NUMBER;
+}
 
-#define STD_CHUNK_SIZE 64
+/* Вспомогательная функция для `evaluate_reduction`. Добавляет в ядро шаг слитого узла */
+error_t _add_fused_step(kernel_t *kernel, const expr_node_t *reduction, expr_node_t *node) {
+	assert(kernel && reduction && node);
+	kernel_step_t step = { .kind = node->operator == PLUS ? ADD : SUBTRACT };
+	error_t error;
+	if (node->operator == MULTIPLY) {
+		const bool is_number_a = _is_number_argument(reduction, node->a);
+		if (is_number_a == _is_number_argument(reduction, node->b))
+			return INVALID_FORMAT;
+		step.kind = SCALE;
+		step.number = is_number_a ? node->a->value.number : node->b->value.number;
+		error = _kernel_argument(kernel, reduction, is_number_a ? node->b : node->a, &step.a);
+	}
+	else if ((error = _kernel_argument(kernel, reduction, node->a, &step.a)) == SUCCESS)
+		error = _kernel_argument(kernel, reduction, node->b, &step.b);
+	if (error != SUCCESS)
+		return error;
+	node->step = add_kernel_step(kernel, &step);
+	return SUCCESS;
+}
 
-/* returns amount of readed chars */
-size_t read_chunk(char *line) {
-	assert(line);
-	char chunk[STD_CHUNK_SIZE];
-	if (!fgets(chunk, STD_CHUNK_SIZE, stdin))
-		return 0;
-	const size_t len = strlen(chunk);
-	memcpy(line, chunk, (len + 1) * sizeof *line);
-	return len;
+/* Вычисляет редукцию вместе со слитыми с ней узлами одним ядром */
+error_t evaluate_reduction(expr_node_t *node) {
+	assert(node && node->n_fused);
+	kernel_t kernel;
+	if (create_kernel(&kernel, 3 * node->n_fused + 2) != SUCCESS)
+		return ALLOC_FAILURE;
+	error_t error = SUCCESS;
+	for (size_t i = 0; i != node->n_fused && error == SUCCESS; ++i)
+		error = _add_fused_step(&kernel, node, node->fused[i]);
+	size_t step_a, step_b = 0;
+	if (error == SUCCESS)
+		error = _kernel_argument(&kernel, node, node->a, &step_a);
+	if (error == SUCCESS && node->b)
+		error = _kernel_argument(&kernel, node, node->b, &step_b);
+	if (error == SUCCESS) {
+		node->value.type = NUMBER;
+		error = run_kernel(&kernel, node->operator, step_a, step_b, &node->value.number);
+	}
+	delete_kernel(&kernel);
+	_release_fused(node);
+	return error;
 }
 
-/* if error — frees memory, sets pointer to NULL and returns true */
-bool handle_realloc_line_error(char **pline, size_t size) {
-	assert(pline && *pline && size);
-	char *tmp = realloc(*pline, size);
-	if (!tmp)
-		free(*pline);
-	*pline = tmp;
-	return !tmp;
+error_t evaluate_node(expr_node_t *node, const stack_node_t *arguments) {
+	assert(node);
+	node->pending = node->uses;
+	error_t error = SUCCESS;
+	if (node->kind != VALUE)  // значение листа-значения разобрано при компиляции
+		init_operand(&node->value);
+	if (node->kind == VALUE)
+		assert(node->evaluated);
+	else if (node->kind == PLACEHOLDER) {
+		const name_t name = { node->text, node->length };
+		const operand_t *value = find_argument(arguments, &name);
+		if (value)
+			node->value = *value;
+		else
+			error = INVALID_FORMAT;
+	}
+	else if (node->n_fused)
+		error = evaluate_reduction(node);
+	else {
+		error = execute(&node->a->value, node->b ? &node->b->value : NULL, &node->value, node->operator);
+		release_node(node->a);
+		if (node->b)
+			release_node(node->b);
+	}
+	if (error != SUCCESS) {
+		node->value.type = NUMBER;
+		return error;
+	}
+	node->evaluated = true;
+	if (!node->pending && _owns_value(node)) {  // например, неиспользованное связывание
+		delete_operand(&node->value);
+		node->evaluated = false;
+	}
+	return SUCCESS;
+}
+
+error_t evaluate_dag(expr_dag_t *dag, const stack_node_t *arguments) {
+	assert(dag);
+	for (expr_node_t *node = dag->first; node; node = node->next) {
+		if (node->fused_into || node->eager)
+			continue;
+		const error_t error = evaluate_node(node, arguments);
+		if (error != SUCCESS)
+			return error;
+	}
+	return SUCCESS;
+}
+
+// ──── program ───────────────────────────────────────────────────────────────────────────────────
+
+// Программа — это последовательность связываний `имя = выражение`, разделённых `;`, за которой
+// следует итоговое выражение, например `x = {1, 2}; 2 * x + x`. Связанное имя можно
+// использовать в последующих выражениях, его значение вычисляется один раз. Несвязанные имена
+// становятся заполнителями, значения которых передаются при вычислении.
+//
+// Программа компилируется из потока за один проход (`compile_stream`): граф строится по мере
+// чтения, а операнды разбираются сразу в листья-значения. Программа без связываний при этом
+// сразу и вычисляется, так что в памяти остаются только ещё нужные значения, а не все векторы
+// ввода. Строка компилируется тем же разбором (`compile_program`), но без вычисления и с
+// постоянными листьями, так как программа вычисляется многократно.
+
+#define BINDING_SYMB        '='
+#define STATEMENT_SEPARATOR ';'
+
+typedef struct {
+	expr_dag_t dag;
+	stack_node_t *texts;  // имена, на которые ссылается граф
+	expr_node_t *root;
+} program_t;
+
+void delete_lines(stack_node_t **lines) {
+	assert(lines);
+	while (*lines) {
+		char **p_line = pop(lines);
+		free(*p_line);
+		free(p_line);
+	}
+}
+
+void delete_program(program_t *program) {
+	assert(program);
+	delete_dag(&program->dag);
+	delete_lines(&program->texts);
+	program->root = NULL;
+}
+
+/* Вспомогательная функция для `compile_stream`. Освобождает выделенную внутри функции память */
+error_t _shutdown_compile_program(error_t error, program_t *program, stack_node_t **bindings) {
+	assert(program && bindings);
+	delete_program(program);
+	delete_stack(bindings);
+	return error;
+}
+
+/* Вспомогательная функция для `compile_stream`. Сливает редукции */
+error_t _finish_compile_program(program_t *program) {
+	assert(program && program->root);
+	++program->root->uses;  // значение корня не должно освобождаться при вычислении
+	const error_t error = fuse_reductions(&program->dag);
+	if (error != SUCCESS)
+		delete_program(program);
+	return error;
+}
+
+/* Цель `emit` для `_build_stream_statement`: операции сразу добавляются в граф */
+typedef struct {
+	expr_dag_t *dag;
+	stack_node_t **nodes;
+	bool eager;           // вычислять операции при разборе
+	size_t n_reductions;  // редукции в стэке операторов: их аргументы не вычисляются при разборе
+} node_target_t;
+
+static inline error_t _emit_node(void *target, operator_t operator) {
+	assert(target);
+	node_target_t *node_target = target;
+	if (is_reduction(operator))
+		--node_target->n_reductions;
+	return handle_push_operation_error(node_target->dag, node_target->nodes, operator,
+		node_target->eager && !node_target->n_reductions);
+}
+
+/* Сохраняет текст имени в программе, если на него ссылаются связывание или заполнитель (`keep`), */
+/* иначе освобождает его. Имена функций и связанных узлов после разбора не нужны.                */
+error_t _keep_program_name(program_t *program, const name_t *name, bool keep) {
+	assert(program && name);
+	char *text = (char *) name->begin;
+	if (!keep) {
+		free(text);
+		return SUCCESS;
+	}
+	const error_t error = push(&program->texts, &text, sizeof text);
+	if (error != SUCCESS)
+		free(text);
+	return error;
+}
+
+/* Ссылается ли узел на вершине стэка на текст имени `name` как новый заполнитель */
+static inline bool _is_new_placeholder(const stack_node_t *nodes, const name_t *name) {
+	assert(nodes && name);
+	const expr_node_t *node = *(expr_node_t *const *) nodes->data;
+	return node->kind == PLACEHOLDER && node->text == name->begin;
 }
 
-/* reads all stdin in string */
-char *read_line(void) {
-	size_t buf_size = STD_BUF_SIZE;
-	char *buf = malloc(buf_size * sizeof *buf);
-	if (!buf)
-		return NULL;
+/* Вспомогательная функция для `_build_stream_statement`. Освобождает стэки алгоритма */
+error_t _shutdown_build_stream_statement(error_t error, stack_node_t **operators, stack_node_t **nodes) {
+	assert(operators && nodes);
+	delete_stack(operators);
+	delete_stack(nodes);
+	return error;
+}
 
-	size_t offset = 0;
-	do {
-		if (offset + STD_CHUNK_SIZE - 1 > buf_size) {
-			buf_size *= STD_BUF_SIZE_MULT;
-			if (handle_realloc_line_error(&buf, buf_size * sizeof *buf))
-				return NULL;
+/* Вспомогательная функция для `compile_stream`. Считывает инструкцию до `;` или конца ввода и */
+/* добавляет её в граф программы алгоритмом сортировочной станции. Если инструкция —           */
+/* связывание, заполняется `binding`. В `*end` записывается, закончилась ли инструкция `;`.    */
+/* Если `eager` и связываний нет, выражение вычисляется по мере разбора.                       */
+error_t _build_stream_statement(
+		program_t *program, const stack_node_t *bindings, input_t *stream,
+		binding_t *binding, bool *is_binding, bool *end, bool eager) {
+	assert(program && stream && binding && is_binding && end);
+	stack_node_t *operators = NULL;
+	stack_node_t *nodes = NULL;
+	node_target_t target = { &program->dag, &nodes, eager && !bindings, 0 };
+	*is_binding = false;
+	for (bool first = true;; first = false) {
+		const char c = peek_char(stream);
+		if (c == EOS || c == STATEMENT_SEPARATOR) {
+			if ((*end = c == STATEMENT_SEPARATOR))
+				skip_char(stream);
+			break;
+		}
+		error_t error;
+		operand_t operand;
+		unsigned long long hash;
+		operator_t operator;
+		if (is_name_head(c)) {
+			name_t name;
+			if ((error = read_name(stream, &name)) != SUCCESS)
+				return _shutdown_build_stream_statement(error, &operators, &nodes);
+			if (first && read_char(stream, BINDING_SYMB) == SUCCESS) {
+				if ((error = _keep_program_name(program, &name, true)) != SUCCESS)
+					return _shutdown_build_stream_statement(error, &operators, &nodes);
+				binding->name = name;
+				*is_binding = true;
+				target.eager = false;
+				continue;
+			}
+			if (peek_char(stream) == OPEN_BRACKET_SYMB && find_function(&name, &operator) == SUCCESS) {
+				_keep_program_name(program, &name, false);
+				skip_char(stream);
+				++target.n_reductions;
+				error = handle_push_operator_error(&operators, operator, _emit_node, &target);
+			}
+			else if ((error = handle_push_name_error(&program->dag, bindings, &nodes, &name)) == SUCCESS)
+				error = _keep_program_name(program, &name, _is_new_placeholder(nodes, &name));
+			else
+				_keep_program_name(program, &name, false);
 		}
-		offset += read_chunk(buf + offset);
-	} while (!feof(stdin));
+		else if ((error = read_operand(stream, &operand, &hash)) == SUCCESS)
+			error = handle_push_value_error(&program->dag, &nodes, &operand, hash, target.eager);
+		else if (error == NOT_AN_OPERAND)
+			error = read_operator(stream, &operator) == SUCCESS
+				? handle_push_operator_error(&operators, operator, _emit_node, &target)
+				: INVALID_FORMAT;
+		if (error != SUCCESS)
+			return _shutdown_build_stream_statement(error, &operators, &nodes);
+	}
+	const error_t error = handle_flush_operators_error(&operators, _emit_node, &target);
+	if (error != SUCCESS || !nodes)
+		return _shutdown_build_stream_statement(error != SUCCESS ? error : INVALID_FORMAT, &operators, &nodes);
+	*(*is_binding ? &binding->node : &program->root) = pop_node(&nodes);
+	if (nodes)
+		return _shutdown_build_stream_statement(INVALID_FORMAT, &operators, &nodes);
+	return SUCCESS;
+}
 
-	// empty input is an error
-	if (!offset) {
-		free(buf);
-		return NULL;
+/* Компилирует программу, считывая её из потока за один проход. Если `eager`, программа без     */
+/* связываний вычисляется уже при разборе, и вычислить её можно только один раз.                 */
+error_t compile_stream(input_t *stream, program_t *program, bool eager) {
+	assert(stream && program);
+	set_allocation_stage("compile");
+	program->texts = NULL;
+	program->root = NULL;
+	if (create_dag(&program->dag) != SUCCESS)
+		return ALLOC_FAILURE;
+	stack_node_t *bindings = NULL;
+	for (bool end = true; end;) {
+		binding_t binding;
+		bool is_binding;
+		error_t error = _build_stream_statement(program, bindings, stream, &binding, &is_binding, &end, eager);
+		// все инструкции, кроме последней, — связывания
+		if (error == SUCCESS && is_binding != end)
+			error = INVALID_FORMAT;
+		if (error == SUCCESS && is_binding)
+			error = push(&bindings, &binding, sizeof binding);
+		if (error != SUCCESS || stream->failed)
+			return _shutdown_compile_program(stream->failed ? IO_FAILURE : error, program, &bindings);
 	}
+	delete_stack(&bindings);
+	return _finish_compile_program(program);
+}
+
+/* Компилирует программу из строки `text` длины `length` для многократного вычисления: значения */
+/* листьев сохраняются между вычислениями до `delete_program`.                                   */
+error_t compile_program(const char *text, size_t length, program_t *program) {
+	assert(text && program);
+	input_t input;
+	open_text_input(&input, text, length);
+	const error_t error = compile_stream(&input, program, false);
+	if (error != SUCCESS)
+		return error;
+	for (expr_node_t *node = program->dag.first; node; node = node->next)
+		node->persistent = node->kind == VALUE;
+	return SUCCESS;
+}
 
-	if (offset + 1 < buf_size)
-		handle_realloc_line_error(&buf, buf_size * sizeof *buf);
+/* Вычисляет программу, `*result` указывает на результат до вызова `reset_program`. Результат —  */
+/* вектор или, если программа заканчивается редукцией, число.                                    */
+error_t evaluate_program(program_t *program, const stack_node_t *arguments, const operand_t **result) {
+	assert(program && program->root && result);
+	set_allocation_stage("evaluate");
+	const error_t error = evaluate_dag(&program->dag, arguments);
+	if (error != SUCCESS)
+		return error;
+	const expr_node_t *root = program->root;
+	if (root->value.type != VECTOR && !(root->kind == OPERATION && is_reduction(root->operator)))
+		return INVALID_FORMAT;
+	*result = &root->value;
+	return SUCCESS;
+}
 
-	return buf;
+/* Подготавливает скомпилированную программу к следующему вычислению */
+static inline void reset_program(program_t *program) {
+	assert(program);
+	reset_dag(&program->dag);
 }
 
+/* Вычисляет программу без заполнителей и удаляет её */
+error_t _calculate_program(program_t *program, operand_t *operand) {
+	assert(program && operand);
+	const operand_t *result;
+	error_t error;
+	if (program->dag.n_placeholders)
+		error = INVALID_FORMAT;
+	else if ((error = evaluate_program(program, NULL, &result)) == SUCCESS) {
+		*operand = *result;
+		program->root->evaluated = false;
+	}
+	delete_program(program);
+	return error;
+}
+
+/* Вычисляет программу без заполнителей, считанную из потока */
+error_t calculate_stream(input_t *stream, operand_t *operand) {
+	assert(stream && operand);
+	program_t program;
+	const error_t error = compile_stream(stream, &program, true);
+	if (error != SUCCESS)
+		return error;
+	return _calculate_program(&program, operand);
+}
+
+// ──── line ──────────────────────────────────────────────────────────────────────────────────────
+
 /* removes spaces */
 void collapse(char *line) {
 	assert(line);
 	char *run = line;
 	while (*run) {
-		while (*run == WHITESPACE || *run == EOL)
-			++run;
-		*line++ = *run++;
+		if (*run != WHITESPACE && *run != EOL)
+			*line++ = *run;
+		++run;
 	}
 	*line = EOS;
 }
 
-static inline void delete_line(char *line) { free(line); }
+// ──── server ────────────────────────────────────────────────────────────────────────────────────
+
+// В режиме сервера (`--server` — запросы из stdin, `--socket PATH` — из Unix-сокета) каждая
+// строка — это запрос вида `x = ОПЕРАНД; y = ОПЕРАНД; ШАБЛОН`. Шаблон — это выражение, свободные
+// имена которого получают значения из запроса. Каждый различный шаблон компилируется один раз и
+// хранится в LRU-кэше, для повторных запросов выполняется только вычисление: операнды шаблона
+// разбираются при компиляции, а его файлы `<path>` остаются отображёнными, пока шаблон в кэше.
+// Ключ кэша — шаблон без пробелов. На каждый запрос выводится строка с результатом или `[error]`.
+
+#define SERVER_OPTION       "--server"
+#define SOCKET_OPTION       "--socket"
+#define TEMPLATE_CACHE_SIZE 64
+#define SOCKET_BACKLOG      16
+
+typedef struct template_t {
+	char *text;
+	unsigned long long hash;
+	program_t program;
+	struct template_t *next;
+} template_t;
+
+typedef struct {
+	template_t *first;  // шаблоны упорядочены от недавно использованного к давно использованному
+	size_t size;
+} template_cache_t;
+
+void delete_template(template_t *template) {
+	assert(template);
+	delete_program(&template->program);
+	free(template->text);
+	free(template);
+}
+
+void delete_template_cache(template_cache_t *cache) {
+	assert(cache);
+	while (cache->first) {
+		template_t *template = cache->first;
+		cache->first = template->next;
+		delete_template(template);
+	}
+	cache->size = 0;
+}
+
+/* Вытесняет из кэша давно использованный шаблон */
+void _evict_template(template_cache_t *cache) {
+	assert(cache && cache->first);
+	template_t **last = &cache->first;
+	while ((*last)->next)
+		last = &(*last)->next;
+	delete_template(*last);
+	*last = NULL;
+	--cache->size;
+}
+
+/* Записывает в `*program` скомпилированный шаблон `text`, при необходимости компилируя его.    */
+/* Шаблон становится первым в кэше.                                                              */
+error_t find_template(template_cache_t *cache, const char *text, program_t **program) {
+	assert(cache && text && program);
+	const size_t length = strlen(text);
+	const unsigned long long hash = hash_text(text, length);
+	for (template_t **run = &cache->first; *run; run = &(*run)->next) {
+		template_t *template = *run;
+		if (template->hash == hash && !strcmp(template->text, text)) {
+			*run = template->next;
+			template->next = cache->first;
+			cache->first = template;
+			*program = &template->program;
+			return SUCCESS;
+		}
+	}
+
+	template_t *template = malloc(sizeof *template);
+	if (!template)
+		return ALLOC_FAILURE;
+	if (!(template->text = malloc((length + 1) * sizeof *template->text)))
+		return _shutdown_with_free(ALLOC_FAILURE, template);
+	memcpy(template->text, text, (length + 1) * sizeof *template->text);
+	template->hash = hash;
+	const error_t error = compile_program(template->text, length, &template->program);
+	if (error != SUCCESS) {
+		free(template->text);
+		return _shutdown_with_free(error, template);
+	}
+	template->next = cache->first;
+	cache->first = template;
+	if (++cache->size > TEMPLATE_CACHE_SIZE)
+		_evict_template(cache);
+	*program = &template->program;
+	return SUCCESS;
+}
+
+void delete_arguments(stack_node_t **arguments) {
+	assert(arguments);
+	while (*arguments) {
+		argument_t *argument = pop(arguments);
+		free((char *) argument->name.begin);
+		delete_operand(&argument->value);
+		free(argument);
+	}
+}
+
+static inline error_t _shutdown_with_delete_arguments(error_t error, stack_node_t **arguments) {
+	assert(arguments);
+	delete_arguments(arguments);
+	return error;
+}
+
+/* Вспомогательная функция для `read_arguments`. Считывает `= ОПЕРАНД;` после имени аргумента */
+error_t _read_argument_value(input_t *request, argument_t *argument) {
+	assert(request && argument);
+	unsigned long long hash;  // аргументы не объединяются
+	error_t error = read_operand(request, &argument->value, &hash);
+	if (error == NOT_AN_OPERAND)
+		error = INVALID_FORMAT;
+	if (error != SUCCESS)
+		return error;
+	if (read_char(request, STATEMENT_SEPARATOR) != SUCCESS)
+		return _shutdown_with_delete_operand(INVALID_FORMAT, &argument->value);
+	return SUCCESS;
+}
+
+/* Считывает аргументы запроса в стэк `arguments`. Непрочитанным остаётся шаблон: он начинается */
+/* с первой инструкции, которая не является связыванием.                                         */
+error_t read_arguments(input_t *request, stack_node_t **arguments) {
+	assert(request && arguments);
+	while (is_name_head(peek_char(request))) {
+		const char *begin = request->run;  // ввод из строки, поэтому к нему можно вернуться
+		argument_t argument;
+		error_t error = read_name(request, &argument.name);
+		if (error != SUCCESS)
+			return _shutdown_with_delete_arguments(error, arguments);
+		if (read_char(request, BINDING_SYMB) != SUCCESS) {
+			free((char *) argument.name.begin);
+			request->run = begin;
+			break;
+		}
+		if ((error = _read_argument_value(request, &argument)) == SUCCESS
+				&& (error = push(arguments, &argument, sizeof argument)) != SUCCESS)
+			delete_operand(&argument.value);
+		if (error != SUCCESS) {
+			free((char *) argument.name.begin);
+			return _shutdown_with_delete_arguments(error, arguments);
+		}
+	}
+	return SUCCESS;
+}
+
+static inline void write_error(void) {
+	for (const char *run = ERROR_MESSAGE; *run; ++run)
+		write_char(*run);
+}
+
+/* Обрабатывает запрос `line` и выводит строку с ответом. Пустой запрос пропускается. Шаблон     */
+/* без пробелов — ключ кэша — записывается в `template`, где должно хватать места на всю строку. */
+void serve_request(template_cache_t *cache, const input_view_t *line, char *template) {
+	assert(cache && line && template);
+	input_t request;
+	open_text_input(&request, line->begin, line->length);
+	if (peek_char(&request) == EOS)
+		return;
+	stack_node_t *arguments = NULL;
+	error_t error = read_arguments(&request, &arguments);
+	program_t *program;
+	if (error == SUCCESS) {
+		const size_t length = request.end - request.run;
+		memcpy(template, request.run, length);
+		template[length] = EOS;
+		collapse(template);
+		error = find_template(cache, template, &program);
+	}
+	if (error == SUCCESS) {
+		const operand_t *result;
+		if ((error = evaluate_program(program, arguments, &result)) == SUCCESS)
+			write_operand(result);
+		reset_program(program);
+	}
+	if (error != SUCCESS)
+		write_error();
+	write_char(EOL);
+	flush_output();
+	delete_arguments(&arguments);
+}
+
+/* Обрабатывает запросы из `stream` до конца ввода */
+error_t serve_stream(template_cache_t *cache, input_t *stream) {
+	assert(cache && stream);
+	char *template = NULL;
+	size_t capacity = 0;
+	for (input_view_t line; read_line_view(stream, &line);) {
+		if (line.length + 1 > capacity) {
+			capacity = maxlu(line.length + 1, capacity * STD_BUF_SIZE_MULT);
+			char *new_template = realloc(template, capacity * sizeof *new_template);
+			if (!new_template)
+				return _shutdown_with_free(ALLOC_FAILURE, template);
+			template = new_template;
+		}
+		serve_request(cache, &line, template);
+	}
+	free(template);
+	return stream->failed ? IO_FAILURE : SUCCESS;
+}
+
+/* Принимает соединения на Unix-сокете `path` и обслуживает их по очереди. Возвращает           */
+/* управление только в случае ошибки.                                                            */
+error_t serve_socket(template_cache_t *cache, const char *path) {
+	assert(cache && path);
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof address.sun_path)
+		return INVALID_FORMAT;
+	strcpy(address.sun_path, path);
+	const int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_fd < 0)
+		return IO_FAILURE;
+	unlink(path);
+	if (bind(server_fd, (const struct sockaddr *) &address, sizeof address)
+			|| listen(server_fd, SOCKET_BACKLOG)) {
+		close(server_fd);
+		return IO_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);  // клиент может закрыть соединение, не дождавшись ответа
+
+	while (true) {
+		const int client_fd = accept(server_fd, NULL, NULL);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		input_t stream;
+		if (open_input(&stream, client_fd)) {
+			output_fd = client_fd;
+			serve_stream(cache, &stream);
+			output_fd = STDOUT_FILENO;
+			close_input(&stream);
+		}
+		close(client_fd);
+	}
+	close(server_fd);
+	unlink(path);
+	return IO_FAILURE;
+}
+
+/* Запускает сервер: из stdin, если `path` равен NULL, иначе из Unix-сокета `path` */
+error_t run_server(const char *path) {
+	template_cache_t cache = { NULL, 0 };
+	error_t error = SUCCESS;
+	input_t stream;
+	if (path)
+		error = serve_socket(&cache, path);
+	else if (!open_input(&stream, STDIN_FILENO))
+		error = ALLOC_FAILURE;
+	else {
+		error = serve_stream(&cache, &stream);
+		close_input(&stream);
+	}
+	delete_template_cache(&cache);
+	return error;
+}
+
+// ──── bench ─────────────────────────────────────────────────────────────────────────────────────
+
+// Сборка с -DBENCHMARK=1 добавляет режим `--bench IO_DIR [SCALE]`. Сначала все пары `iNN`/`oNN`
+// из IO_DIR проверяются как тесты. Пары из IO_DIR/server проверяются в режиме `--server`: каждая
+// строка `iNN` — запрос, а `oNN` — ответы на них по строке на запрос. Пары из IO_DIR/binary
+// проверяются в режиме `--binary`, `oNN` в нём — упакованные координаты. В IO_DIR/mapped лежат
+// тесты с файлами `<path>` и сами файлы. Каждый тест выполняется из своего каталога, так что
+// пути в нём задаются относительно него. Только если все тесты пройдены, на выражениях из
+// детерминированного генератора отдельно замеряется каждая стадия: `compile_stream`,
+// `evaluate_program` и `write_operand` (выражения без связываний и редукций вычисляются уже
+// в `compile_stream`). Для стадий выводятся лучшее и среднее
+// время, количество и объём выделений памяти, для каждого выражения — пик RSS. Генератор строит
+// глубоко вложенные скобки, длинные цепочки операций, несколько огромных векторов и множество
+// крошечных, каждое в трёх размерах, умноженных на SCALE. В обычной сборке режима нет и
+// функции выделения памяти не подменяются.
+
+#ifndef BENCHMARK
+#define BENCHMARK 0
+#endif
+
+#if BENCHMARK
+
+#define BENCH_OPTION  "--bench"
+#define BENCH_REPEATS 3
+#define BENCH_SEED    0x9E3779B97F4A7C15ull
+
+// glibc разрешает программе заменить функции выделения памяти, исходные доступны как __libc_*.
+// Имена взяты в скобки, чтобы их не раскрыли макросы TRACK_ALLOCATIONS.
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *data, size_t size);
+void __libc_free(void *data);
+
+static struct {
+	size_t count;
+	size_t bytes;
+} allocations;
+
+void *(malloc)(size_t size) {
+	++allocations.count;
+	allocations.bytes += size;
+	return __libc_malloc(size);
+}
+
+void *(calloc)(size_t n, size_t size) {
+	++allocations.count;
+	allocations.bytes += n * size;
+	return __libc_calloc(n, size);
+}
+
+void *(realloc)(void *data, size_t size) {
+	++allocations.count;
+	allocations.bytes += size;
+	return __libc_realloc(data, size);
+}
+
+void (free)(void *data) { __libc_free(data); }
+
+static inline double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/* Сбрасывает пик RSS процесса (Linux). Возвращает false, если сбросить не удалось */
+bool reset_peak_rss(void) {
+	const int fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0)
+		return false;
+	const bool success = write(fd, "5", 1) == 1;
+	close(fd);
+	return success;
+}
+
+static inline long peak_rss_kib(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/* Открывает файл `path` как ввод и записывает в `view` всё его содержимое. Ввод нужно закрыть */
+bool read_file_view(const char *path, input_t *input, input_view_t *view) {
+	assert(path && input && view);
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	const bool opened = open_input(input, fd);
+	const bool success = opened && read_input_view(input, view);
+	close(fd);
+	if (opened && !success)
+		close_input(input);
+	return success;
+}
+
+/* Убирает завершающие переводы строк */
+static inline size_t trim_eol(const char *text, size_t size) {
+	assert(text || !size);
+	while (size && text[size - 1] == EOL)
+		--size;
+	return size;
+}
+
+/* Режим, в котором выполняются тесты каталога */
+typedef enum {
+	IO_EXPRESSION = 0,
+	IO_SERVER,
+	IO_BINARY   // `--binary`, ответ сравнивается побайтово
+} io_mode_t;
+
+/* Подкаталоги IO_DIR с тестами режимов сервера и т. п. */
+static const struct {
+	const char *name;
+	io_mode_t mode;
+} IO_SUBDIRS[] = {
+	{ "server", IO_SERVER },
+	{ "binary", IO_BINARY },
+	{ "mapped", IO_EXPRESSION },
+};
+
+/* Выполняет тест из `fd`, как это делает `main` в режиме `mode`, и выводит ответ в `output_fd` */
+void run_io_case(int fd, io_mode_t mode) {
+	assert(fd >= 0);
+	input_t stream;
+	operand_t result;
+	error_t error = open_input(&stream, fd) ? SUCCESS : ALLOC_FAILURE;
+	if (error == SUCCESS && mode == IO_SERVER) {
+		template_cache_t cache = { NULL, 0 };
+		serve_stream(&cache, &stream);
+		delete_template_cache(&cache);
+		close_input(&stream);
+		return;
+	}
+	if (error == SUCCESS) {
+		error = calculate_stream(&stream, &result);
+		close_input(&stream);
+	}
+	if (error != SUCCESS)
+		write_error();
+	else if (mode == IO_BINARY)
+		write_operand_binary(&result);
+	else
+		write_operand(&result);
+	if (error == SUCCESS)
+		delete_operand(&result);
+	flush_output();
+}
+
+/* Проверяет пару `iNN`/`oNN`. Ответ пишется в файл `capture` и сравнивается с `oNN` без учёта */
+/* завершающих переводов строк, а в режиме IO_BINARY — побайтово.                               */
+bool check_io_case(const char *dir, const char *name, io_mode_t mode, int capture) {
+	assert(dir && name && name[0] == 'i');
+	char input_path[PATH_MAX], output_path[PATH_MAX];
+	snprintf(input_path, sizeof input_path, "%s/%s", dir, name);
+	snprintf(output_path, sizeof output_path, "%s/o%s", dir, name + 1);
+	input_t expected_input;
+	input_view_t expected;
+	const int input_fd = open(input_path, O_RDONLY);
+	if (!read_file_view(output_path, &expected_input, &expected)) {
+		if (input_fd >= 0)
+			close(input_fd);
+		return false;
+	}
+	bool passed = input_fd >= 0 && !ftruncate(capture, 0);
+	if (passed) {
+		output_fd = capture;
+		lseek(capture, 0, SEEK_SET);
+		run_io_case(input_fd, mode);
+		output_fd = STDOUT_FILENO;
+		const off_t size = lseek(capture, 0, SEEK_CUR);
+		char *actual = malloc((size + 1) * sizeof *actual);
+		const bool trim = mode != IO_BINARY;
+		const size_t expected_size = trim ? trim_eol(expected.begin, expected.length) : expected.length;
+		passed = actual && pread(capture, actual, size, 0) == size
+			&& (trim ? trim_eol(actual, size) : (size_t) size) == expected_size
+			&& !memcmp(actual, expected.begin, expected_size);
+		free(actual);
+	}
+	if (input_fd >= 0)
+		close(input_fd);
+	close_input(&expected_input);
+	return passed;
+}
+
+/* Вспомогательная функция для `run_io_gate`. Проверяет пары `iNN`/`oNN` из `dir` в режиме      */
+/* `mode`, добавляя их к счётчикам. Тесты выполняются из `dir`, поэтому пути `<path>` в них     */
+/* задаются относительно него. Возвращает false, если каталог не открылся.                       */
+bool _run_io_dir(const char *dir, io_mode_t mode, int capture, size_t *passed, size_t *failed) {
+	assert(dir && passed && failed);
+	const int cwd = open(".", O_RDONLY | O_DIRECTORY);
+	DIR *entries = cwd >= 0 && !chdir(dir) ? opendir(".") : NULL;
+	if (!entries) {
+		printf("io: cannot open %s\n", dir);
+		if (cwd >= 0 && fchdir(cwd))
+			perror("io");
+		if (cwd >= 0)
+			close(cwd);
+		return false;
+	}
+	for (struct dirent *entry; (entry = readdir(entries));) {
+		if (entry->d_name[0] != 'i')
+			continue;
+		if (check_io_case(".", entry->d_name, mode, capture))
+			++*passed;
+		else {
+			printf("io: FAIL %s/%s\n", dir, entry->d_name);
+			++*failed;
+		}
+	}
+	closedir(entries);
+	const bool restored = !fchdir(cwd);
+	close(cwd);
+	return restored;
+}
+
+/* Проверяет все пары `iNN`/`oNN` из `dir` и его подкаталогов IO_SUBDIRS. Возвращает true, если */
+/* все тесты пройдены.                                                                           */
+bool run_io_gate(const char *dir) {
+	assert(dir);
+	FILE *capture = tmpfile();
+	if (!capture) {
+		printf("io: cannot create a capture file\n");
+		return false;
+	}
+	size_t passed = 0, failed = 0;
+	bool opened = _run_io_dir(dir, IO_EXPRESSION, fileno(capture), &passed, &failed);
+	for (size_t i = 0; opened && i != sizeof IO_SUBDIRS / sizeof *IO_SUBDIRS; ++i) {
+		char subdir[PATH_MAX];
+		snprintf(subdir, sizeof subdir, "%s/%s", dir, IO_SUBDIRS[i].name);
+		opened = _run_io_dir(subdir, IO_SUBDIRS[i].mode, fileno(capture), &passed, &failed);
+	}
+	fclose(capture);
+	printf("io: %zu passed, %zu failed\n", passed, failed);
+	return opened && !failed && passed;
+}
+
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+} text_t;
+
+typedef enum {
+	NESTING = 0,   // `V * k + (V - (V * k + (... V)))`
+	CHAIN,         // `V + V * k - V + ...`, векторы размерности CHAIN_DIMENSION
+	HUGE_VECTORS,  // `V + V * 3 - V` с огромными векторами
+	TINY_VECTORS,  // `{a, b} + {c, d} + ...`
+	N_SHAPES
+} shape_t;
+
+static const struct {
+	const char *name;
+	size_t base_size;  // глубина, количество операндов или размерность
+} SHAPES[N_SHAPES] = {
+	[NESTING]      = { "nesting", 64 },
+	[CHAIN]        = { "chain",   256 },
+	[HUGE_VECTORS] = { "huge",    1024 },
+	[TINY_VECTORS] = { "tiny",    1024 },
+};
+
+#define NESTING_DIMENSION 4
+#define CHAIN_DIMENSION   8
+#define MAX_COMPONENT     1000
+#define MAX_FACTOR        3
+#define SIZE_STEPS        3   // размеры base_size * SCALE * SIZE_MULT^i
+#define SIZE_MULT         4
+
+static inline uint64_t next_random(uint64_t *state) {
+	assert(state);
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+error_t append_text(text_t *text, const char *data) {
+	assert(text && data);
+	const size_t size = strlen(data);
+	if (text->size + size + 1 > text->capacity) {
+		const size_t capacity = maxlu((text->size + size + 1) * STD_BUF_SIZE_MULT, STD_BUF_SIZE);
+		char *new_data = realloc(text->data, capacity * sizeof *new_data);
+		if (!new_data)
+			return ALLOC_FAILURE;
+		text->data = new_data;
+		text->capacity = capacity;
+	}
+	memcpy(text->data + text->size, data, (size + 1) * sizeof *data);
+	text->size += size;
+	return SUCCESS;
+}
+
+error_t append_number(text_t *text, uint64_t number) {
+	assert(text);
+	char buf[MAX_NUMBER_LENGTH + 1];
+	snprintf(buf, sizeof buf, "%" PRIu64, number);
+	return append_text(text, buf);
+}
+
+/* Дописывает вектор со случайными координатами из [0, MAX_COMPONENT) */
+error_t append_random_vector(text_t *text, uint64_t *state, size_t dimension) {
+	assert(text && state && dimension >= MIN_VECTOR_DIMENSION);
+	error_t error = append_text(text, "{");
+	for (size_t i = 0; i != dimension && error == SUCCESS; ++i) {
+		if (i)
+			error = append_text(text, ", ");
+		if (error == SUCCESS)
+			error = append_number(text, next_random(state) % MAX_COMPONENT);
+	}
+	return error == SUCCESS ? append_text(text, "}") : error;
+}
+
+/* Дописывает случайный множитель ` * k` */
+static inline error_t append_random_factor(text_t *text, uint64_t *state) {
+	assert(text && state);
+	const error_t error = append_text(text, " * ");
+	return error == SUCCESS ? append_number(text, 1 + next_random(state) % MAX_FACTOR) : error;
+}
+
+/* Строит выражение формы `shape` размера `size`. Для одинаковых аргументов результат одинаков */
+error_t generate_expression(shape_t shape, size_t size, text_t *text) {
+	assert(shape < N_SHAPES && size && text);
+	uint64_t state = BENCH_SEED ^ (shape + 1) * size;
+	text->size = 0;
+	error_t error = append_text(text, "");
+	switch (shape) {
+	case NESTING:
+		for (size_t i = 0; i != size && error == SUCCESS; ++i) {
+			error = append_random_vector(text, &state, NESTING_DIMENSION);
+			if (error == SUCCESS && i % 2 == 0)
+				error = append_random_factor(text, &state);
+			if (error == SUCCESS)
+				error = append_text(text, i % 2 ? " - (" : " + (");
+		}
+		if (error == SUCCESS)
+			error = append_random_vector(text, &state, NESTING_DIMENSION);
+		for (size_t i = 0; i != size && error == SUCCESS; ++i)
+			error = append_text(text, ")");
+		return error;
+	case CHAIN:
+		for (size_t i = 0; i != size && error == SUCCESS; ++i) {
+			if (i)
+				error = append_text(text, next_random(&state) % 2 ? " + " : " - ");
+			if (error == SUCCESS)
+				error = append_random_vector(text, &state, CHAIN_DIMENSION);
+			if (error == SUCCESS && next_random(&state) % 3 == 0)
+				error = append_random_factor(text, &state);
+		}
+		return error;
+	case HUGE_VECTORS:
+		if (error == SUCCESS)
+			error = append_random_vector(text, &state, size);
+		if (error == SUCCESS)
+			error = append_text(text, " + ");
+		if (error == SUCCESS)
+			error = append_random_vector(text, &state, size);
+		if (error == SUCCESS)
+			error = append_text(text, " * 3 - ");
+		if (error == SUCCESS)
+			error = append_random_vector(text, &state, size);
+		return error;
+	case TINY_VECTORS:
+		for (size_t i = 0; i != size && error == SUCCESS; ++i) {
+			if (i)
+				error = append_text(text, " + ");
+			if (error == SUCCESS)
+				error = append_random_vector(text, &state, MIN_VECTOR_DIMENSION);
+		}
+		return error;
+	default:
+		assert(0);
+		return INVALID_FORMAT;
+	}
+}
+
+typedef enum {
+	COMPILE = 0,
+	EVALUATE,
+	WRITE,
+	N_STAGES
+} stage_t;
+
+static const char *const STAGE_NAMES[N_STAGES] = {
+	[COMPILE]  = "compile_stream",
+	[EVALUATE] = "evaluate_program",
+	[WRITE]    = "write_operand",
+};
+
+typedef struct {
+	double best, total;  // секунды
+	size_t allocations;  // за последний запуск
+	size_t bytes;
+} measure_t;
+
+typedef struct {
+	measure_t stages[N_STAGES];
+	double start;
+	size_t start_allocations;
+	size_t start_bytes;
+} measures_t;
+
+static inline void start_stage(measures_t *measures) {
+	assert(measures);
+	measures->start_allocations = allocations.count;
+	measures->start_bytes = allocations.bytes;
+	measures->start = now();
+}
+
+static inline void finish_stage(measures_t *measures, stage_t stage) {
+	assert(measures && stage < N_STAGES);
+	const double elapsed = now() - measures->start;
+	measure_t *measure = measures->stages + stage;
+	measure->best = measure->total && measure->best < elapsed ? measure->best : elapsed;
+	measure->total += elapsed;
+	measure->allocations = allocations.count - measures->start_allocations;
+	measure->bytes = allocations.bytes - measures->start_bytes;
+}
+
+/* Вспомогательная функция для `bench_expression`. Один раз проходит все стадии */
+error_t _bench_once(const text_t *text, measures_t *measures) {
+	assert(text && measures);
+	input_t stream;
+	open_text_input(&stream, text->data, text->size);
+	program_t program;
+	start_stage(measures);
+	error_t error = compile_stream(&stream, &program, true);
+	finish_stage(measures, COMPILE);
+	if (error != SUCCESS)
+		return error;
+
+	const operand_t *result;
+	start_stage(measures);
+	error = evaluate_program(&program, NULL, &result);
+	finish_stage(measures, EVALUATE);
+
+	if (error == SUCCESS) {
+		start_stage(measures);
+		write_operand(result);
+		flush_output();
+		finish_stage(measures, WRITE);
+	}
+	delete_program(&program);
+	return error;
+}
+
+/* Замеряет стадии на выражении и печатает строки таблицы */
+error_t bench_expression(const char *name, size_t size, const text_t *text) {
+	assert(name && text);
+	measures_t measures = { 0 };
+	const bool reset = reset_peak_rss();
+	for (size_t i = 0; i != BENCH_REPEATS; ++i) {
+		const error_t error = _bench_once(text, &measures);
+		if (error != SUCCESS)
+			return error;
+	}
+	for (stage_t stage = 0; stage != N_STAGES; ++stage) {
+		const measure_t *measure = measures.stages + stage;
+		printf("%-8s %8zu %10zu  %-17s %10.3f %10.3f %9zu %12zu\n",
+				name, size, text->size, STAGE_NAMES[stage], measure->best * 1e3,
+				measure->total / BENCH_REPEATS * 1e3, measure->allocations, measure->bytes);
+	}
+	printf("%-8s %8zu %10zu  peak RSS %ld KiB%s\n",
+			name, size, text->size, peak_rss_kib(), reset ? "" : " (since start)");
+	return SUCCESS;
+}
+
+/* Режим `--bench`. Возвращает false, если тесты не пройдены или замер не удался */
+bool run_bench(const char *io_dir, size_t scale) {
+	assert(io_dir && scale);
+	if (!run_io_gate(io_dir))
+		return false;
+	const int null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0)
+		return false;
+	output_fd = null_fd;
+	printf("%-8s %8s %10s  %-17s %10s %10s %9s %12s\n",
+			"shape", "size", "chars", "stage", "best, ms", "mean, ms", "allocs", "bytes");
+	text_t text = { 0 };
+	error_t error = SUCCESS;
+	for (shape_t shape = 0; shape != N_SHAPES && error == SUCCESS; ++shape) {
+		size_t size = SHAPES[shape].base_size * scale;
+		for (size_t i = 0; i != SIZE_STEPS && error == SUCCESS; ++i, size *= SIZE_MULT)
+			if ((error = generate_expression(shape, size, &text)) == SUCCESS)
+				error = bench_expression(SHAPES[shape].name, size, &text);
+	}
+	free(text.data);
+	output_fd = STDOUT_FILENO;
+	close(null_fd);
+	if (error != SUCCESS)
+		printf("bench: error %d\n", error);
+	return error == SUCCESS;
+}
+
+#endif  // BENCHMARK
 
 // ──── main ──────────────────────────────────────────────────────────────────────────────────────
 
 static inline int _shutdown_with_error(void) {
-	puts("[error]");
+	puts(ERROR_MESSAGE);
 	return 0;
 }
 
-int main(void) {
-	char *infix_expr = read_line();
-	if (!infix_expr)
+#define BINARY_OUTPUT_OPTION "--binary"
+
+/* С опцией `--binary` результат выводится упакованными координатами, как в файлах `<path>`.    */
+/* С опциями `--server` и `--socket PATH` программа работает в режиме сервера, с `--bench` —     */
+/* в режиме замеров (только в сборке с BENCHMARK).                                              */
+int main(int argc, char *argv[]) {
+#if BENCHMARK
+	if ((argc == 3 || argc == 4) && !strcmp(argv[1], BENCH_OPTION)) {
+		const size_t scale = argc == 4 ? strtoul(argv[3], NULL, 10) : 1;
+		return scale && run_bench(argv[2], scale) ? 0 : 1;
+	}
+#endif
+	if (argc == 2 && !strcmp(argv[1], SERVER_OPTION))
+		return run_server(NULL) == SUCCESS ? 0 : _shutdown_with_error();
+	if (argc == 3 && !strcmp(argv[1], SOCKET_OPTION))
+		return run_server(argv[2]) == SUCCESS ? 0 : _shutdown_with_error();
+
+	const bool binary_output = argc == 2 && !strcmp(argv[1], BINARY_OUTPUT_OPTION);
+	if (argc > 1 && !binary_output)
 		return _shutdown_with_error();
-	collapse(infix_expr);
-	char *postfix_expr;
-	error_t error = shunting_yard(infix_expr, &postfix_expr);
-	delete_line(infix_expr);
-	if (error != SUCCESS)
+	input_t stream;
+	if (!open_input(&stream, STDIN_FILENO))
 		return _shutdown_with_error();
-	vector_t vector;
-	error = calculate(postfix_expr, &vector);
-	delete_line(postfix_expr);
+	operand_t result;
+	const error_t error = calculate_stream(&stream, &result);
+	close_input(&stream);
 	if (error != SUCCESS)
 		return _shutdown_with_error();
-	write_vector(&vector);
-	delete_vector(&vector);
+	if (binary_output)
+		write_operand_binary(&result);
+	else {
+		write_operand(&result);
+		flush_output();
+	}
+	delete_operand(&result);
 }
@@ -0,0 +1,162 @@
+/*
+ * Общий для задач A и B учёт динамической памяти
+ *
+ * Керимов А.
+ * АПО-13
+ */
+
+// Сборка с -DTRACK_ALLOCATIONS=1 учитывает динамическую память по местам выделения: `malloc`,
+// `calloc`, `realloc` и `free` заменяются макросами, и каждый блок помечается именем функции,
+// которая его выделила. Для каждой метки считаются текущий и пиковый объём и количество
+// выделений, для всей программы — пиковый объём и стадия (`set_allocation_stage`), на которой он
+// достигнут. Отчёт выводится в stderr при завершении программы. В обычной сборке макросов нет и
+// используется стандартный аллокатор.
+//
+// Модуль подключается после системных заголовков, но до кода программы и `common/input.h`,
+// чтобы макросы заменили все их выделения памяти. Поэтому все его функции `static inline`.
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TRACK_ALLOCATIONS
+#define TRACK_ALLOCATIONS 0
+#endif
+
+#if TRACK_ALLOCATIONS
+
+#define MAX_ALLOCATION_TAGS 64
+
+static const char OTHER_ALLOCATIONS_TAG[] = "(other)";
+
+typedef struct {
+	const char *name;  // `__func__` места выделения
+	size_t current, peak;  // байты
+	size_t count;
+} allocation_tag_t;
+
+static struct {
+	allocation_tag_t tags[MAX_ALLOCATION_TAGS];
+	size_t n_tags;
+	size_t current, peak;
+	const char *stage;
+	const char *peak_stage;
+} tracker = { .stage = "start", .peak_stage = "start" };
+
+/* Заголовок перед каждым блоком. Выравнивание блока остаётся таким же, как у `malloc` */
+typedef struct {
+	_Alignas(max_align_t) size_t size;
+	allocation_tag_t *tag;
+} allocation_header_t;
+
+static inline void write_allocation_report(void) {
+	fprintf(stderr, "allocations: peak %zu bytes at stage %s\n", tracker.peak, tracker.peak_stage);
+	fprintf(stderr, "%-32s %12s %12s %9s\n", "tag", "current", "peak", "count");
+	for (size_t i = 0; i != tracker.n_tags; ++i) {
+		const allocation_tag_t *tag = tracker.tags + i;
+		fprintf(stderr, "%-32s %12zu %12zu %9zu\n", tag->name, tag->current, tag->peak, tag->count);
+	}
+}
+
+/* Метки сравниваются по адресу: у каждой функции свой `__func__` */
+static inline allocation_tag_t *_find_allocation_tag(const char *name) {
+	for (size_t i = 0; i != tracker.n_tags; ++i)
+		if (tracker.tags[i].name == name)
+			return tracker.tags + i;
+	if (!tracker.n_tags)
+		atexit(write_allocation_report);
+	// последняя метка собирает все места, которым не хватило меток
+	if (tracker.n_tags == MAX_ALLOCATION_TAGS - 1 && name != OTHER_ALLOCATIONS_TAG)
+		return _find_allocation_tag(OTHER_ALLOCATIONS_TAG);
+	allocation_tag_t *tag = tracker.tags + tracker.n_tags++;
+	tag->name = name;
+	return tag;
+}
+
+static inline void _track_block(allocation_header_t *header, allocation_tag_t *tag, size_t size) {
+	header->size = size;
+	header->tag = tag;
+	if ((tag->current += size) > tag->peak)
+		tag->peak = tag->current;
+	if ((tracker.current += size) > tracker.peak) {
+		tracker.peak = tracker.current;
+		tracker.peak_stage = tracker.stage;
+	}
+}
+
+static inline void _untrack_block(const allocation_header_t *header) {
+	header->tag->current -= header->size;
+	tracker.current -= header->size;
+}
+
+static inline void *tracked_malloc(size_t size, const char *name) {
+	if (size > SIZE_MAX - sizeof (allocation_header_t))
+		return NULL;
+	allocation_header_t *header = (malloc)(sizeof *header + size);
+	if (!header)
+		return NULL;
+	allocation_tag_t *tag = _find_allocation_tag(name);
+	++tag->count;
+	_track_block(header, tag, size);
+	return header + 1;
+}
+
+static inline void *tracked_calloc(size_t n, size_t size, const char *name) {
+	if (size && n > (SIZE_MAX - sizeof (allocation_header_t)) / size)
+		return NULL;
+	allocation_header_t *header = (calloc)(1, sizeof *header + n * size);
+	if (!header)
+		return NULL;
+	allocation_tag_t *tag = _find_allocation_tag(name);
+	++tag->count;
+	_track_block(header, tag, n * size);
+	return header + 1;
+}
+
+/* Блок переходит к метке `realloc`, так как её место определяет новый размер */
+static inline void *tracked_realloc(void *data, size_t size, const char *name) {
+	if (!data)
+		return tracked_malloc(size, name);
+	if (size > SIZE_MAX - sizeof (allocation_header_t))
+		return NULL;
+	allocation_header_t *header = (allocation_header_t *) data - 1;
+	allocation_tag_t *old_tag = header->tag;
+	const size_t old_size = header->size;
+	_untrack_block(header);
+	allocation_header_t *new_header = (realloc)(header, sizeof *header + size);
+	if (!new_header) {
+		_track_block(header, old_tag, old_size);
+		return NULL;
+	}
+	allocation_tag_t *tag = _find_allocation_tag(name);
+	++tag->count;
+	_track_block(new_header, tag, size);
+	return new_header + 1;
+}
+
+static inline void tracked_free(void *data) {
+	if (!data)
+		return;
+	allocation_header_t *header = (allocation_header_t *) data - 1;
+	_untrack_block(header);
+	(free)(header);
+}
+
+static inline void set_allocation_stage(const char *stage) { tracker.stage = stage; }
+
+#define malloc(size)        tracked_malloc(size, __func__)
+#define calloc(n, size)     tracked_calloc(n, size, __func__)
+#define realloc(data, size) tracked_realloc(data, size, __func__)
+#define free(data)          tracked_free(data)
+
+#else
+
+static inline void set_allocation_stage(const char *stage) { (void) stage; }
+
+#endif  // TRACK_ALLOCATIONS
+
+#endif  // ALLOC_H
@@ -0,0 +1,186 @@
+/*
+ * Общий для задач A и B буферизованный ввод
+ *
+ * Керимов А.
+ * АПО-13
+ */
+
+// Ввод `input_t` читается из файлового дескриптора через `read(2)` блоками по INPUT_BLOCK_SIZE.
+// Если дескриптор — обычный файл, он целиком отображается в память и не копируется вовсе. Ввод
+// может быть задан и готовой строкой.
+//
+// Непрочитанная часть ввода — это [run, end). Посимвольное чтение двигает `run` само и вызывает
+// `fill_input`, когда символы закончились. `read_line_view` и `read_input_view` возвращают
+// представления `input_view_t`, которые ссылаются прямо в буфер ввода. Представление строки
+// действительно до следующего чтения из того же ввода, представление всего ввода — до
+// `close_input`.
+//
+// Модуль подключается внутрь программы после её замены функций выделения памяти, поэтому все
+// его функции `static inline`.
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INPUT_BLOCK_SIZE      (1 << 16)
+#define INPUT_BLOCK_SIZE_MULT 2
+
+typedef struct {
+	const char *begin;
+	size_t length;
+} input_view_t;
+
+typedef struct {
+	int fd;            // дескриптор, из которого ещё можно читать, иначе -1
+	char *buf;         // блоки `read(2)`, NULL для отображённого файла и строки
+	size_t capacity;
+	void *map;         // отображённый файл или NULL
+	size_t map_size;
+	const char *run;
+	const char *end;
+	bool failed;       // ошибка чтения или выделения памяти
+} input_t;
+
+/* Отображает в память обычный файл `fd` от текущей позиции. Возвращает false, если это          */
+/* невозможно, и тогда файл читается блоками.                                                    */
+static inline bool _map_input(input_t *input, int fd) {
+	assert(input && fd >= 0);
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return false;
+	const off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return false;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	input->map = map;
+	input->map_size = st.st_size;
+	input->run = (const char *) map + offset;
+	input->end = (const char *) map + st.st_size;
+	return true;
+}
+
+/* Открывает ввод из `fd`, сам дескриптор не закрывается. Возвращает false, если не хватило    */
+/* памяти на буфер.                                                                              */
+static inline bool open_input(input_t *input, int fd) {
+	assert(input && fd >= 0);
+	input->fd = -1;
+	input->buf = NULL;
+	input->capacity = 0;
+	input->map = NULL;
+	input->map_size = 0;
+	input->failed = false;
+	if (_map_input(input, fd))
+		return true;
+	if (!(input->buf = malloc(INPUT_BLOCK_SIZE * sizeof *input->buf)))
+		return false;
+	input->fd = fd;
+	input->capacity = INPUT_BLOCK_SIZE;
+	input->run = input->end = input->buf;
+	return true;
+}
+
+static inline void open_text_input(input_t *input, const char *text, size_t length) {
+	assert(input && (text || !length));
+	input->fd = -1;
+	input->buf = NULL;
+	input->capacity = 0;
+	input->map = NULL;
+	input->map_size = 0;
+	input->run = text;
+	input->end = text + length;
+	input->failed = false;
+}
+
+static inline void close_input(input_t *input) {
+	assert(input);
+	free(input->buf);
+	if (input->map)
+		munmap(input->map, input->map_size);
+	input->buf = NULL;
+	input->map = NULL;
+	input->run = input->end = NULL;
+	input->fd = -1;
+}
+
+/* Дочитывает следующий блок. Непрочитанная часть ввода переносится в начало буфера, а если     */
+/* она занимает его целиком, буфер расширяется. Возвращает false в конце ввода или в случае     */
+/* ошибки.                                                                                       */
+static inline bool fill_input(input_t *input) {
+	assert(input);
+	if (input->fd < 0 || input->failed)
+		return false;
+	const size_t left = input->end - input->run;
+	if (left == input->capacity) {
+		char *buf = realloc(input->buf, input->capacity * INPUT_BLOCK_SIZE_MULT * sizeof *buf);
+		if (!buf) {
+			input->failed = true;
+			return false;
+		}
+		input->buf = buf;
+		input->capacity *= INPUT_BLOCK_SIZE_MULT;
+	}
+	else if (left && input->run != input->buf)
+		memmove(input->buf, input->run, left);
+	input->run = input->buf;
+	input->end = input->buf + left;
+
+	ssize_t n_read;
+	while ((n_read = read(input->fd, input->buf + left, input->capacity - left)) < 0 && errno == EINTR)
+		;
+	if (n_read <= 0) {
+		input->failed = n_read < 0;
+		input->fd = -1;
+		return false;
+	}
+	input->end += n_read;
+	return true;
+}
+
+/* Записывает в `line` следующую строку вместе с переводом строки, если он есть. Возвращает     */
+/* false в конце ввода или в случае ошибки.                                                      */
+static inline bool read_line_view(input_t *input, input_view_t *line) {
+	assert(input && line);
+	size_t scanned = 0;
+	const char *eol;
+	while (!(eol = input->run != input->end
+			? memchr(input->run + scanned, '\n', input->end - input->run - scanned) : NULL)) {
+		scanned = input->end - input->run;
+		if (!fill_input(input)) {
+			if (input->failed || !scanned)
+				return false;
+			eol = input->end - 1;  // последняя строка без перевода строки
+			break;
+		}
+	}
+	line->begin = input->run;
+	line->length = eol + 1 - input->run;
+	input->run = eol + 1;
+	return true;
+}
+
+/* Записывает в `view` весь оставшийся ввод. Возвращает false в случае ошибки */
+static inline bool read_input_view(input_t *input, input_view_t *view) {
+	assert(input && view);
+	while (fill_input(input))
+		;
+	if (input->failed)
+		return false;
+	view->begin = input->run;
+	view->length = input->end - input->run;
+	input->run = input->end;
+	return true;
+}
+
+#endif  // INPUT_H